@@ -9,11 +9,19 @@
 #include <thread>
 #include <poll.h>
 #include <signal.h>
+#include <sys/epoll.h>
 #include <sys/signalfd.h>
 #include <sys/stat.h>
+#include <sys/timerfd.h>
+
+#include <libcamera/base/unique_fd.h>
 
 #include "core/rpicam_mjpeg_encoder.hpp"
+#include "output/container_output.hpp"
+#include "output/http_output_mjpeg.hpp"
 #include "output/output.hpp"
+#include "output/shm_output_mjpeg.hpp"
+#include "output/socket_output_mjpeg.hpp"
 #include "core/pipe.hpp"
 
 using namespace std::placeholders;
@@ -21,10 +29,20 @@ using namespace std::placeholders;
 // Some keypress/signal handling.
 
 static int signal_received;
-static void default_signal_handler(int signal_number)
+
+// The signals we respond to. They're blocked in every thread and read from a signalfd in the main loop.
+static sigset_t handledSignals()
 {
-	signal_received = signal_number;
-	LOG(2, "Received signal " << signal_number);
+	sigset_t signals;
+	sigemptyset(&signals);
+	sigaddset(&signals, SIGUSR1);
+	sigaddset(&signals, SIGUSR2);
+	sigaddset(&signals, SIGINT);
+	// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
+	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
+	// signal to be able to react on it, otherwise the app terminates.
+	sigaddset(&signals, SIGPIPE);
+	return signals;
 }
 
 static int get_key_or_signal(MJPEGOptions const *options, pollfd p[1])
@@ -56,17 +74,73 @@ static int get_key_or_signal(MJPEGOptions const *options, pollfd p[1])
 
 static std::unique_ptr<Output> createVideoOutput(MJPEGOptions const *options, RPiCamMJPEGEncoder &app)
 {
-	std::unique_ptr<Output> video_output =  std::unique_ptr<Output>(Output::Create((VideoOptions*) options));
+	// Recordings made from the preview's JPEGs just need putting in a container file.
+	std::unique_ptr<Output> video_output = std::unique_ptr<Output>(options->video_from_preview
+																	  ? new ContainerOutput((VideoOptions*) options)
+																	  : Output::Create((VideoOptions*) options));
 	app.SetVideoEncodeOutputReadyCallback(std::bind(&Output::OutputReady, video_output.get(), _1, _2, _3, _4));
 	app.SetVideoMetadataReadyCallback(std::bind(&Output::MetadataReady, video_output.get(), _1));
 	return video_output;
 }
 
-static std::unique_ptr<Output> createLoresOutput(MJPEGOptions const *options, RPiCamMJPEGEncoder &app)
+// Outputs for the extra preview sizes, the HTTP stream, the Unix socket and the shared memory ring. These come and
+// go with the main lores output.
+struct PreviewOutputs
+{
+	std::vector<std::unique_ptr<Output>> sizes;
+	std::unique_ptr<Output> http;
+	std::unique_ptr<Output> socket;
+	std::unique_ptr<Output> shm;
+};
+
+static std::unique_ptr<Output> createLoresOutput(MJPEGOptions const *options, RPiCamMJPEGEncoder &app,
+												 PreviewOutputs &preview_outputs)
 {
 	std::unique_ptr<Output> lores_output = std::unique_ptr<Output>(Output::Create((VideoOptions*) options, &app));
-	app.SetLoresEncodeOutputReadyCallback(std::bind(&Output::OutputReady, lores_output.get(), _1, _2, _3, _4));
+	std::vector<Output *> outputs = { lores_output.get() };
+	MJPEGOptions const *http_options = app.GetPreviewHttpOptions();
+	HttpOutputMJPEG *http_output = nullptr;
+	if (http_options)
+	{
+		http_output = new HttpOutputMJPEG((VideoOptions*) http_options);
+		preview_outputs.http.reset(http_output);
+		outputs.push_back(http_output);
+	}
+	MJPEGOptions const *socket_options = app.GetPreviewSocketOptions();
+	SocketOutputMJPEG *socket_output = nullptr;
+	if (socket_options)
+	{
+		socket_output = new SocketOutputMJPEG((VideoOptions*) socket_options);
+		preview_outputs.socket.reset(socket_output);
+		outputs.push_back(socket_output);
+	}
+	MJPEGOptions const *shm_options = app.GetPreviewShmOptions();
+	if (shm_options)
+	{
+		preview_outputs.shm.reset(new ShmOutputMJPEG((VideoOptions*) shm_options, shm_options->preview_shm_slots,
+													  shm_options->preview_shm_slot_size));
+		outputs.push_back(preview_outputs.shm.get());
+	}
+	// Connected clients keep the preview going when --preview-idle-timeout would otherwise stop it.
+	app.SetPreviewClientsCallback([http_output, socket_output]() {
+		return (http_output && http_output->Clients()) || (socket_output && socket_output->Clients());
+	});
+	if (outputs.size() > 1)
+		app.SetLoresEncodeOutputReadyCallback([outputs](void *mem, size_t size, int64_t timestamp_us, bool keyframe) {
+			for (Output *output : outputs)
+				output->OutputReady(mem, size, timestamp_us, keyframe);
+		});
+	else
+		app.SetLoresEncodeOutputReadyCallback(std::bind(&Output::OutputReady, lores_output.get(), _1, _2, _3, _4));
 	app.SetLoresMetadataReadyCallback(std::bind(&Output::MetadataReady, lores_output.get(), _1));
+
+	std::vector<EncodeOutputReadyCallback> size_callbacks;
+	for (auto const &size_options : app.GetPreviewSizeOptions())
+	{
+		preview_outputs.sizes.emplace_back(Output::Create((VideoOptions*) size_options.get(), &app));
+		size_callbacks.push_back(std::bind(&Output::OutputReady, preview_outputs.sizes.back().get(), _1, _2, _3, _4));
+	}
+	app.SetLoresSizeOutputReadyCallbacks(size_callbacks);
 	return lores_output;
 }
 
@@ -80,9 +154,10 @@ static std::unique_ptr<Output> startVideoOutput(MJPEGOptions const *options, RPi
 	return video_output;
 }
 
-static std::unique_ptr<Output> startLoresOutput(MJPEGOptions const *options, RPiCamMJPEGEncoder &app)
+static std::unique_ptr<Output> startLoresOutput(MJPEGOptions const *options, RPiCamMJPEGEncoder &app,
+												PreviewOutputs &preview_outputs)
 {
-	std::unique_ptr<Output> lores_output = createLoresOutput(options, app);
+	std::unique_ptr<Output> lores_output = createLoresOutput(options, app, preview_outputs);
 	app.StartLoresEncoder();
 	return lores_output;
 }
@@ -93,13 +168,21 @@ static void stopVideoOutput(std::unique_ptr<Output> &video_output, RPiCamMJPEGEn
 	video_output.reset();
 }
 
-static void stopLoresOutput(std::unique_ptr<Output> &lores_output, RPiCamMJPEGEncoder &app)
+static void stopLoresOutput(std::unique_ptr<Output> &lores_output, PreviewOutputs &preview_outputs,
+							RPiCamMJPEGEncoder &app)
 {
+	// The encoder is stopped first, so nothing is still being written to the outputs as they go.
 	app.StopLoresEncoder();
+	app.SetPreviewClientsCallback(nullptr);
 	lores_output.reset();
+	preview_outputs.sizes.clear();
+	preview_outputs.http.reset();
+	preview_outputs.socket.reset();
+	preview_outputs.shm.reset();
 }
 
-static void teardownMJPEG(RPiCamMJPEGEncoder &app, std::unique_ptr<Output> &video_output, std::unique_ptr<Output> &lores_output)
+static void teardownMJPEG(RPiCamMJPEGEncoder &app, std::unique_ptr<Output> &video_output,
+						  std::unique_ptr<Output> &lores_output, PreviewOutputs &preview_outputs)
 {
 	app.StopCamera();
 
@@ -107,7 +190,7 @@ static void teardownMJPEG(RPiCamMJPEGEncoder &app, std::unique_ptr<Output> &vide
 	if (app.IsVideoOutputting())
 		stopVideoOutput(video_output, app);
 	if (app.IsLoresOutputting())
-		stopLoresOutput(lores_output, app);
+		stopLoresOutput(lores_output, preview_outputs, app);
 
 	app.Teardown();
 }
@@ -138,11 +221,11 @@ static void saveImage(CompletedRequestPtr &completed_request, RPiCamMJPEGEncoder
 	app.SaveImage(completed_request, app.ImageStream());
 }
 
-static std::unique_ptr<Output> startMJPEG(RPiCamMJPEGEncoder &app)
+static std::unique_ptr<Output> startMJPEG(RPiCamMJPEGEncoder &app, PreviewOutputs &preview_outputs)
 {
 	app.ConfigureMJPEG();
 
-	std::unique_ptr<Output> lores_output = startLoresOutput(app.GetLoresOptions(), app);
+	std::unique_ptr<Output> lores_output = startLoresOutput(app.GetLoresOptions(), app, preview_outputs);
 	if (!app.IsImageSaverStarted())
 		app.StartImageSaver();
 	app.StartCamera();
@@ -157,12 +240,13 @@ static std::unique_ptr<Output> startMJPEG(RPiCamMJPEGEncoder &app)
 // 	return startMJPEG(app);
 // }
 
-static void stopMJPEG(RPiCamMJPEGEncoder &app, std::unique_ptr<Output> &video_output, std::unique_ptr<Output> &lores_output)
+static void stopMJPEG(RPiCamMJPEGEncoder &app, std::unique_ptr<Output> &video_output,
+					  std::unique_ptr<Output> &lores_output, PreviewOutputs &preview_outputs)
 {
 	if (app.IsImageSaverStarted())
 		app.StopImageSaver();
 	
-	teardownMJPEG(app, video_output, lores_output);
+	teardownMJPEG(app, video_output, lores_output, preview_outputs);
 }
 
 static std::unique_ptr<Output> encodeVideoBuffer(CompletedRequestPtr &completed_request, RPiCamMJPEGEncoder &app, std::unique_ptr<Output> &video_output)
@@ -188,6 +272,46 @@ static std::unique_ptr<Output> encodeVideoBuffer(CompletedRequestPtr &completed_
 }
 
 
+enum EventSource
+{
+	EVENT_MESSAGE,
+	EVENT_CONTROL,
+	EVENT_SIGNAL,
+	EVENT_KEYPRESS,
+	EVENT_CAPTURE_TIMER,
+	EVENT_SPLIT_TIMER
+};
+
+static void addEvent(int epoll_fd, int fd, EventSource source)
+{
+	if (fd < 0)
+		return;
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.u32 = source;
+	if (epoll_ctl(epoll_fd, EPOLL_CTL_ADD, fd, &event) < 0)
+		throw std::runtime_error("failed to add fd to main loop: " + std::string(strerror(errno)));
+}
+
+// Read an eventfd or timerfd so that it stops being readable.
+static void clearEvent(int fd)
+{
+	uint64_t value;
+	[[maybe_unused]] ssize_t ret = read(fd, &value, sizeof(value));
+}
+
+// Start a timer going off after the given time, and then repeatedly if asked. A zero time stops it.
+static void setTimer(int fd, std::chrono::duration<double> time, bool repeat)
+{
+	int64_t ns = std::chrono::duration_cast<std::chrono::nanoseconds>(time).count();
+	itimerspec spec = {};
+	spec.it_value.tv_sec = ns / 1000000000;
+	spec.it_value.tv_nsec = ns % 1000000000;
+	if (repeat)
+		spec.it_interval = spec.it_value;
+	timerfd_settime(fd, 0, &spec, nullptr);
+}
+
 static void event_loop(RPiCamMJPEGEncoder &app)
 {
 	if (!app.IsRestartRequested())
@@ -203,27 +327,33 @@ static void event_loop(RPiCamMJPEGEncoder &app)
 
 	std::unique_ptr<Output> video_output;
 	std::unique_ptr<Output> lores_output;
+	PreviewOutputs preview_outputs;
 
-	lores_output = startMJPEG(app);
+	lores_output = startMJPEG(app, preview_outputs);
 
 	auto start_time = std::chrono::high_resolution_clock::now();
 
-	// Monitoring for keypresses and signals.
-	signal(SIGUSR1, default_signal_handler);
-	signal(SIGUSR2, default_signal_handler);
-	signal(SIGINT, default_signal_handler);
-	// SIGPIPE gets raised when trying to write to an already closed socket. This can happen, when
-	// you're using TCP to stream to VLC and the user presses the stop button in VLC. Catching the
-	// signal to be able to react on it, otherwise the app terminates.
-	signal(SIGPIPE, default_signal_handler);
+	// Everything the loop waits for is in one epoll set: camera messages, control commands, signals,
+	// keypresses and the video capture duration and split interval timers. So commands are handled as
+	// soon as they arrive, whether or not the camera is delivering frames.
+	libcamera::UniqueFD epoll_fd(epoll_create1(EPOLL_CLOEXEC));
+	sigset_t signals = handledSignals();
+	libcamera::UniqueFD signal_fd(signalfd(-1, &signals, SFD_NONBLOCK | SFD_CLOEXEC));
+	libcamera::UniqueFD capture_timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+	libcamera::UniqueFD split_timer_fd(timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC));
+	if (!epoll_fd.isValid() || !signal_fd.isValid() || !capture_timer_fd.isValid() || !split_timer_fd.isValid())
+		throw std::runtime_error("failed to create main loop fds");
+	addEvent(epoll_fd.get(), app.MessageFd(), EVENT_MESSAGE);
+	addEvent(epoll_fd.get(), app.ControlFIFOFd(), EVENT_CONTROL);
+	addEvent(epoll_fd.get(), signal_fd.get(), EVENT_SIGNAL);
+	addEvent(epoll_fd.get(), capture_timer_fd.get(), EVENT_CAPTURE_TIMER);
+	addEvent(epoll_fd.get(), split_timer_fd.get(), EVENT_SPLIT_TIMER);
+	if (options->keypress)
+		addEvent(epoll_fd.get(), STDIN_FILENO, EVENT_KEYPRESS);
 	pollfd p[1] = { { STDIN_FILENO, POLLIN, 0 } };
 
-	for (unsigned int count = 0; ; count++)
+	for (unsigned int count = 0; ;)
 	{
-		// if number of microseconds since last fifo read time exceeds options->fifo_interval, read from fifo
-		if (std::chrono::duration_cast<std::chrono::microseconds>(std::chrono::high_resolution_clock::now() - app.GetLastFifoReadTime()).count() >= options->fifo_interval)
-			app.ReadControlFIFO();
-
 		// now we check if we need to process any commands
 		FIFORequest fifo_request = app.GetFifoRequest();
 		if (fifo_request != FIFORequest::NONE)
@@ -237,24 +367,30 @@ static void event_loop(RPiCamMJPEGEncoder &app)
 				case FIFORequest::STOP:
 					LOG(2, "Stopping application");
 					// app.ClosePipes();
-					stopMJPEG(app, video_output, lores_output);
+					stopMJPEG(app, video_output, lores_output, preview_outputs);
 					return;
 				case FIFORequest::RESTART:
 					LOG(2, "Restarting application");
 					// stopMJPEG(app, video_output, lores_output);
-					teardownMJPEG(app, video_output, lores_output);
+					teardownMJPEG(app, video_output, lores_output, preview_outputs);
 					app.RequestRestart(true);
 					return;
 				case FIFORequest::START_VIDEO:
 					video_output = startVideoOutput(video_options, app, true);
+					// A duration given with "ca 1" is for this capture only.
+					setTimer(capture_timer_fd.get(), app.GetVideoCaptureDuration(), false);
+					setTimer(split_timer_fd.get(), app.GetVideoSplitInterval(), true);
+					app.SetVideoCaptureDuration(options->video_capture_duration);
 					break;
 				case FIFORequest::STOP_VIDEO:
 					stopVideoOutput(video_output, app);
+					setTimer(capture_timer_fd.get(), std::chrono::duration<double>(0), false);
+					setTimer(split_timer_fd.get(), std::chrono::duration<double>(0), false);
 					break;
 				case FIFORequest::CAPTURE_IMAGE:
 					if (!options->image_no_teardown)
 					{
-						teardownMJPEG(app, video_output, lores_output);
+						teardownMJPEG(app, video_output, lores_output, preview_outputs);
 						configureImage(app);
 					}
 					app.RequestImage();
@@ -267,25 +403,11 @@ static void event_loop(RPiCamMJPEGEncoder &app)
 					break;
 			}
 		}
-		
-		RPiCamMJPEGEncoder::Msg msg = app.Wait();
-		if (msg.type == RPiCamApp::MsgType::Timeout)
-		{
-			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
-			app.StopCamera();
-			app.StartCamera();
-			continue;
-		}
-		if (msg.type == RPiCamMJPEGEncoder::MsgType::Quit)
-			return;
-		else if (msg.type != RPiCamMJPEGEncoder::MsgType::RequestComplete)
-			throw std::runtime_error("unrecognised message received from camera!");
-		
+
 		int key = get_key_or_signal(options, p);
 		if (key == '\n' && app.IsVideoOutputting())
 			video_output->Signal();
 
-		LOG(2, "Viewfinder frame " << count);
 		auto now = std::chrono::high_resolution_clock::now();
 		bool timeout = !options->frames && options->timeout &&
 					   ((now - start_time) > options->timeout.value);
@@ -295,9 +417,82 @@ static void event_loop(RPiCamMJPEGEncoder &app)
 			if (timeout)
 				LOG(2, "Halting: reached timeout of " << options->timeout.get<std::chrono::milliseconds>()
 													  << " milliseconds.");
-			stopMJPEG(app, video_output, lores_output);
+			stopMJPEG(app, video_output, lores_output, preview_outputs);
 			return;
 		}
+
+		std::optional<RPiCamMJPEGEncoder::Msg> next_msg = app.TryWait();
+		if (!next_msg)
+		{
+			int timeout_ms = -1;
+			if (!options->frames && options->timeout)
+				timeout_ms = std::chrono::duration_cast<std::chrono::milliseconds>(
+								 options->timeout.value - (now - start_time)).count() + 1;
+			epoll_event events[8];
+			int n = epoll_wait(epoll_fd.get(), events, 8, timeout_ms);
+			if (n < 0 && errno != EINTR)
+				throw std::runtime_error("epoll_wait failed: " + std::string(strerror(errno)));
+			for (int i = 0; i < n; i++)
+			{
+				switch (events[i].data.u32)
+				{
+				case EVENT_MESSAGE:
+					clearEvent(app.MessageFd());
+					break;
+				case EVENT_CONTROL:
+					app.ReadControlFIFO();
+					break;
+				case EVENT_SIGNAL:
+				{
+					signalfd_siginfo info;
+					while (read(signal_fd.get(), &info, sizeof(info)) == sizeof(info))
+					{
+						signal_received = info.ssi_signo;
+						LOG(2, "Received signal " << signal_received);
+					}
+					break;
+				}
+				case EVENT_CAPTURE_TIMER:
+					clearEvent(capture_timer_fd.get());
+					if (app.IsVideoOutputting())
+					{
+						LOG(1, "Video capture duration reached, stopping video capture");
+						stopVideoOutput(video_output, app);
+						setTimer(split_timer_fd.get(), std::chrono::duration<double>(0), false);
+					}
+					break;
+				case EVENT_SPLIT_TIMER:
+					clearEvent(split_timer_fd.get());
+					if (app.IsVideoOutputting())
+					{
+						LOG(2, "Video split interval reached, saving to new video file");
+						stopVideoOutput(video_output, app);
+						video_output = startVideoOutput(video_options, app);
+					}
+					break;
+				case EVENT_KEYPRESS:
+					// Picked up by get_key_or_signal.
+					break;
+				}
+			}
+			continue;
+		}
+
+		RPiCamMJPEGEncoder::Msg &msg = *next_msg;
+		count++;
+		if (msg.type == RPiCamApp::MsgType::Timeout)
+		{
+			LOG_ERROR("ERROR: Device timeout detected, attempting a restart!!!");
+			app.StopCamera();
+			app.StartCamera();
+			continue;
+		}
+		if (msg.type == RPiCamMJPEGEncoder::MsgType::Quit)
+			return;
+		else if (msg.type != RPiCamMJPEGEncoder::MsgType::RequestComplete)
+			throw std::runtime_error("unrecognised message received from camera!");
+		
+		LOG(2, "Viewfinder frame " << count);
 		CompletedRequestPtr &completed_request = std::get<CompletedRequestPtr>(msg.payload);
 		
 		if (app.IsImageRequested())
@@ -307,7 +502,7 @@ static void event_loop(RPiCamMJPEGEncoder &app)
 			{
 				app.StopCamera();
 				app.Teardown();
-				lores_output = startMJPEG(app);
+				lores_output = startMJPEG(app, preview_outputs);
 				continue;
 			}
 		}
@@ -321,6 +516,9 @@ static void event_loop(RPiCamMJPEGEncoder &app)
 int main(int argc, char *argv[])
 {
 	std::cout << "Starting rpicam_mjpeg" << std::endl;
+	// Block the signals we handle before any threads start, so that they all leave them to the main loop.
+	sigset_t signals = handledSignals();
+	pthread_sigmask(SIG_BLOCK, &signals, nullptr);
 	std::unique_ptr<RPiCamMJPEGEncoder> app = std::make_unique<RPiCamMJPEGEncoder>();
 	try
 	{
@@ -0,0 +1,401 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * rpicam_mjpeg_bench.cpp - MJPEG encoder benchmark, needing no camera.
+ */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <condition_variable>
+#include <fstream>
+#include <iomanip>
+#include <iostream>
+#include <map>
+#include <mutex>
+#include <random>
+#include <sstream>
+#include <thread>
+#include <type_traits>
+#include <vector>
+
+#include <sys/resource.h>
+#include <time.h>
+
+#include <boost/program_options.hpp>
+
+#include "core/logging.hpp"
+#include "encoder/mjpeg_encoder.hpp"
+
+using Clock = std::chrono::steady_clock;
+
+struct BenchOptions
+{
+	unsigned int width;
+	unsigned int height;
+	unsigned int stride;
+	unsigned int frames;
+	float fps;
+	float complexity;
+	std::string input;
+	unsigned int buffers;
+	std::vector<unsigned int> threads;
+	std::vector<int> qualities;
+	unsigned int strips;
+	std::string backend;
+	bool staging;
+	std::string grayscale;
+	unsigned int queue_depth;
+};
+
+struct BenchResult
+{
+	unsigned int frames_output = 0;
+	uint64_t frames_dropped = 0;
+	unsigned int frames_stalled = 0;
+	double seconds = 0;
+	double cpu_seconds = 0;
+	uint64_t bytes = 0;
+	std::vector<double> latencies_ms;
+	// How long each input buffer was held, from EncodeBuffer to the input done callback.
+	std::vector<double> hold_ms;
+};
+
+template <typename T>
+static std::vector<T> parse_list(std::string const &list)
+{
+	std::vector<T> values;
+	std::stringstream ss(list);
+	std::string item;
+	while (std::getline(ss, item, ','))
+	{
+		int value = std::stoi(item);
+		if (std::is_unsigned_v<T> && value < 0)
+			throw std::runtime_error("negative value in list \"" + list + "\"");
+		values.push_back(value);
+	}
+	if (values.empty())
+		throw std::runtime_error("empty list \"" + list + "\"");
+	return values;
+}
+
+static bool parse_options(int argc, char *argv[], BenchOptions &options)
+{
+	using namespace boost::program_options;
+
+	std::string threads, qualities;
+	unsigned int verbose;
+	options_description desc("Feeds YUV420 frames to the MJPEG encoder and reports its throughput, latency from "
+							 "EncodeBuffer to the output callback, how long it holds each input buffer, output size "
+							 "and CPU time. Every combination of --threads and --quality is run in turn.\n\n"
+							 "Valid options are");
+	// clang-format off
+	desc.add_options()
+		("help,h", "Print this help message")
+		("width", value<unsigned int>(&options.width)->default_value(640), "Frame width")
+		("height", value<unsigned int>(&options.height)->default_value(480), "Frame height")
+		("stride", value<unsigned int>(&options.stride)->default_value(0),
+			"Row stride of the Y plane in bytes. 0 rounds the width up to a multiple of 64, like the camera")
+		("frames", value<unsigned int>(&options.frames)->default_value(300), "Number of frames to encode in each run")
+		("fps", value<float>(&options.fps)->default_value(0),
+			"Feed frames at this rate, dropping a frame (as the camera would) when no input buffer is free. 0 feeds "
+			"frames as fast as input buffers are returned")
+		("complexity", value<float>(&options.complexity)->default_value(0.5),
+			"Content of the synthetic frames, from 0 (flat grey) through 0.5 (smooth gradients and edges) to 1 "
+			"(random noise)")
+		("input", value<std::string>(&options.input),
+			"Encode frames read from this file of packed YUV420 (I420) frames at --width x --height instead")
+		("buffers", value<unsigned int>(&options.buffers)->default_value(0),
+			"Number of input buffers, which the frames cycle through. 0 means 4 synthetic frames, or every frame in "
+			"the --input file")
+		("threads", value<std::string>(&threads)->default_value("0"),
+			"Comma separated list of encode thread counts to run. 0 uses the encoder's default")
+		("quality", value<std::string>(&qualities)->default_value("80"),
+			"Comma separated list of JPEG qualities to run")
+		("strips", value<unsigned int>(&options.strips)->default_value(1),
+			"Horizontal strips to encode each frame in, as --preview-strips")
+		("backend", value<std::string>(&options.backend)->default_value("libjpeg"),
+			"JPEG library to use, as --preview-backend")
+		("staging", value<bool>(&options.staging)->default_value(false)->implicit_value(true),
+			"Copy each frame before encoding it, as --preview-staging")
+		("grayscale", value<std::string>(&options.grayscale)->default_value("off"),
+			"Grayscale mode, as --preview-grayscale")
+		("queue-depth", value<unsigned int>(&options.queue_depth)->default_value(0),
+			"Maximum frames waiting to be encoded, as --preview-queue-depth. 0 means unlimited")
+		("verbose,v", value<unsigned int>(&verbose)->default_value(0), "Encoder logging level");
+	// clang-format on
+
+	variables_map vm;
+	store(parse_command_line(argc, argv, desc), vm);
+	notify(vm);
+	if (vm.count("help"))
+	{
+		std::cout << desc;
+		return false;
+	}
+
+	RPiCamApp::verbosity = verbose;
+	options.threads = parse_list<unsigned int>(threads);
+	options.qualities = parse_list<int>(qualities);
+	if (!options.stride)
+		options.stride = (options.width + 63) & ~63;
+	if (options.width < 16 || options.height < 16 || (options.width | options.height | options.stride) & 1 ||
+		options.stride < options.width)
+		throw std::runtime_error("invalid frame size " + std::to_string(options.width) + "x" +
+								 std::to_string(options.height) + " stride " + std::to_string(options.stride));
+	if (options.fps < 0 || options.complexity < 0 || options.complexity > 1 || !options.frames)
+		throw std::runtime_error("invalid --fps, --complexity or --frames");
+	for (int quality : options.qualities)
+		if (quality < 1 || quality > 100)
+			throw std::runtime_error("invalid quality " + std::to_string(quality));
+	return true;
+}
+
+// Draw a test frame. Up to a complexity of 0.5 this fades in a moving pattern of gradients and
+// hard edges, and after that adds ever more noise.
+static void synthesise_frame(std::vector<uint8_t> &frame, BenchOptions const &options, unsigned int n)
+{
+	unsigned int width = options.width, height = options.height, stride = options.stride;
+	float structure = std::min(1.0f, 2 * options.complexity);
+	float noise = std::max(0.0f, 2 * options.complexity - 1);
+	unsigned int shift = n * 8;
+	std::mt19937 rng(n);
+	std::uniform_int_distribution<int> random(-128, 127);
+
+	uint8_t *Y = frame.data();
+	for (unsigned int y = 0; y < height; y++)
+		for (unsigned int x = 0; x < width; x++)
+		{
+			float value = 50 * std::sin((x + shift) / 23.0f) * std::cos(y / 19.0f) +
+						  ((((x + shift) / 32 + y / 32) & 1) ? 30 : -30);
+			Y[y * stride + x] = std::clamp<int>(128 + structure * value + noise * random(rng), 0, 255);
+		}
+
+	uint8_t *U = Y + stride * height;
+	uint8_t *V = U + stride / 2 * (height / 2);
+	for (unsigned int y = 0; y < height / 2; y++)
+		for (unsigned int x = 0; x < width / 2; x++)
+		{
+			U[y * (stride / 2) + x] = std::clamp<int>(128 + structure * 40 * std::sin((x + shift) / 51.0f) +
+														  noise * random(rng) / 2, 0, 255);
+			V[y * (stride / 2) + x] =
+				std::clamp<int>(128 + structure * 40 * std::cos(y / 37.0f) + noise * random(rng) / 2, 0, 255);
+		}
+}
+
+static std::vector<std::vector<uint8_t>> make_buffers(BenchOptions const &options)
+{
+	size_t size = options.stride * options.height * 3 / 2;
+	std::vector<std::vector<uint8_t>> buffers;
+
+	if (options.input.empty())
+	{
+		buffers.resize(options.buffers ? options.buffers : 4, std::vector<uint8_t>(size, 128));
+		for (unsigned int i = 0; i < buffers.size(); i++)
+			synthesise_frame(buffers[i], options, i);
+		return buffers;
+	}
+
+	std::ifstream file(options.input, std::ios::binary);
+	if (!file)
+		throw std::runtime_error("failed to open " + options.input);
+	// The file has no padding, so copy each row into place with our stride.
+	std::vector<char> row(options.width);
+	while (!options.buffers || buffers.size() < options.buffers)
+	{
+		std::vector<uint8_t> buffer(size, 128);
+		uint8_t *dest = buffer.data();
+		for (unsigned int y = 0; y < options.height * 2 && file; y++)
+		{
+			// Height rows of Y, then height / 2 rows each of U and V at half the width and stride.
+			unsigned int width = y < options.height ? options.width : options.width / 2;
+			unsigned int stride = y < options.height ? options.stride : options.stride / 2;
+			file.read(row.data(), width);
+			std::copy(row.begin(), row.begin() + width, dest);
+			dest += stride;
+		}
+		if (!file)
+			break;
+		buffers.push_back(std::move(buffer));
+	}
+	if (buffers.empty())
+		throw std::runtime_error("no complete frames in " + options.input);
+	return buffers;
+}
+
+static double thread_cpu_seconds()
+{
+	timespec ts;
+	clock_gettime(CLOCK_THREAD_CPUTIME_ID, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static double process_cpu_seconds()
+{
+	rusage usage;
+	getrusage(RUSAGE_SELF, &usage);
+	return usage.ru_utime.tv_sec + usage.ru_stime.tv_sec + (usage.ru_utime.tv_usec + usage.ru_stime.tv_usec) / 1e6;
+}
+
+static BenchResult run(BenchOptions const &options, std::vector<std::vector<uint8_t>> &buffers, unsigned int threads,
+					   int quality)
+{
+	MJPEGOptions mjpeg_options;
+	mjpeg_options.codec = "mjpeg";
+	mjpeg_options.quality = quality;
+	mjpeg_options.encode_threads = threads;
+	mjpeg_options.encode_strips = options.strips;
+	mjpeg_options.encode_backend = options.backend;
+	mjpeg_options.encode_staging = options.staging;
+	mjpeg_options.encode_grayscale = options.grayscale;
+	mjpeg_options.encode_queue_depth = options.queue_depth;
+
+	StreamInfo info;
+	info.width = options.width;
+	info.height = options.height;
+	info.stride = options.stride;
+	size_t size = options.stride * options.height * 3 / 2;
+	// Timestamps follow the frame rate, so that anything in the encoder that looks at them sees a
+	// plausible stream.
+	int64_t interval_us = options.fps ? 1e6 / options.fps : 33333;
+
+	BenchResult result;
+	std::mutex mutex;
+	std::condition_variable cond;
+	std::map<void *, unsigned int> buffer_index;
+	std::vector<bool> busy(buffers.size(), false);
+	std::vector<Clock::time_point> submit_time(options.frames);
+	// When each input buffer was last handed to the encoder.
+	std::vector<Clock::time_point> held_since(buffers.size());
+	Clock::time_point last_output;
+	for (unsigned int i = 0; i < buffers.size(); i++)
+		buffer_index[buffers[i].data()] = i;
+	result.latencies_ms.reserve(options.frames);
+	result.hold_ms.reserve(options.frames);
+
+	std::unique_ptr<Encoder> encoder(Encoder::Create(&mjpeg_options, info));
+	MjpegEncoder *mjpeg_encoder = dynamic_cast<MjpegEncoder *>(encoder.get());
+	encoder->SetInputDoneCallback([&](void *mem) {
+		Clock::time_point now = Clock::now();
+		std::lock_guard<std::mutex> lock(mutex);
+		unsigned int index = buffer_index.at(mem);
+		result.hold_ms.push_back(std::chrono::duration<double, std::milli>(now - held_since[index]).count());
+		busy[index] = false;
+		cond.notify_all();
+	});
+	encoder->SetOutputReadyCallback([&](void *mem, size_t bytes, int64_t timestamp_us, bool) {
+		Clock::time_point now = Clock::now();
+		std::lock_guard<std::mutex> lock(mutex);
+		result.latencies_ms.push_back(
+			std::chrono::duration<double, std::milli>(now - submit_time[timestamp_us / interval_us]).count());
+		result.bytes += bytes;
+		result.frames_output++;
+		last_output = now;
+		cond.notify_all();
+	});
+
+	// The encode threads are idle until the first frame arrives, so all the CPU time used from now
+	// on, apart from this thread's, is the encoder's.
+	double cpu_start = process_cpu_seconds(), feeder_cpu_start = thread_cpu_seconds();
+	Clock::time_point start = Clock::now();
+	unsigned int submitted = 0;
+	for (unsigned int i = 0; i < options.frames; i++)
+	{
+		unsigned int index = i % buffers.size();
+		{
+			std::unique_lock<std::mutex> lock(mutex);
+			if (options.fps)
+			{
+				lock.unlock();
+				std::this_thread::sleep_until(start + std::chrono::microseconds(i * interval_us));
+				lock.lock();
+				if (busy[index])
+				{
+					result.frames_stalled++;
+					continue;
+				}
+			}
+			else
+				cond.wait(lock, [&] { return !busy[index]; });
+			busy[index] = true;
+			submit_time[i] = held_since[index] = Clock::now();
+		}
+		encoder->EncodeBuffer(-1, size, buffers[index].data(), info, i * interval_us);
+		submitted++;
+	}
+
+	// Frames the encoder dropped will never be output.
+	result.frames_dropped = mjpeg_encoder ? mjpeg_encoder->DroppedFrames() : 0;
+	{
+		std::unique_lock<std::mutex> lock(mutex);
+		if (!cond.wait_for(lock, std::chrono::seconds(30),
+						   [&] { return result.frames_output + result.frames_dropped >= submitted; }))
+			throw std::runtime_error("timed out waiting for the encoder");
+	}
+	// With every frame dropped there's no last output, so the run lasted until now.
+	Clock::time_point end = result.frames_output ? last_output : Clock::now();
+	result.seconds = std::chrono::duration<double>(end - start).count();
+	result.cpu_seconds = process_cpu_seconds() - cpu_start - (thread_cpu_seconds() - feeder_cpu_start);
+	return result;
+}
+
+static double percentile(std::vector<double> const &sorted, double p)
+{
+	if (sorted.empty())
+		return 0;
+	return sorted[std::min<size_t>(sorted.size() - 1, p * sorted.size())];
+}
+
+int main(int argc, char *argv[])
+{
+	try
+	{
+		BenchOptions options;
+		if (!parse_options(argc, argv, options))
+			return 0;
+
+		std::vector<std::vector<uint8_t>> buffers = make_buffers(options);
+		std::cout << options.width << "x" << options.height << " stride " << options.stride << ", ";
+		if (options.input.empty())
+			std::cout << "synthetic complexity " << options.complexity;
+		else
+			std::cout << options.input;
+		std::cout << ", " << buffers.size() << " buffers, " << options.frames << " frames";
+		if (options.fps)
+			std::cout << " at " << options.fps << "fps";
+		std::cout << std::endl;
+		std::cout << "threads quality    fps  p50 ms  p90 ms  p99 ms  max ms  hold p50  hold p99  bytes/frame  "
+					 "cpu ms/frame  cpu %  dropped  stalled"
+				  << std::endl;
+
+		for (unsigned int threads : options.threads)
+		{
+			for (int quality : options.qualities)
+			{
+				BenchResult result = run(options, buffers, threads, quality);
+				std::vector<double> &latencies = result.latencies_ms;
+				std::sort(latencies.begin(), latencies.end());
+				std::vector<double> &hold = result.hold_ms;
+				std::sort(hold.begin(), hold.end());
+				unsigned int frames = std::max(result.frames_output, 1u);
+				double seconds = result.seconds > 0 ? result.seconds : 1;
+				std::cout << std::fixed << std::setprecision(1) << std::setw(7) << threads << std::setw(8) << quality
+						  << std::setw(7) << result.frames_output / seconds << std::setw(8)
+						  << percentile(latencies, 0.5) << std::setw(8) << percentile(latencies, 0.9)
+						  << std::setw(8) << percentile(latencies, 0.99) << std::setw(8)
+						  << (latencies.empty() ? 0 : latencies.back()) << std::setw(10) << percentile(hold, 0.5)
+						  << std::setw(10) << percentile(hold, 0.99) << std::setw(13) << result.bytes / frames
+						  << std::setw(14) << result.cpu_seconds * 1000 / frames << std::setw(7)
+						  << 100 * result.cpu_seconds / seconds << std::setw(9) << result.frames_dropped
+						  << std::setw(9) << result.frames_stalled << std::endl;
+			}
+		}
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: *** " << e.what() << " ***");
+		return -1;
+	}
+	return 0;
+}
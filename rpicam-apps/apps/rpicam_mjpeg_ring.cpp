@@ -0,0 +1,94 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * rpicam_mjpeg_ring.cpp - Read preview JPEGs from rpicam-mjpeg's shared memory ring.
+ */
+
+#include <chrono>
+#include <cstdio>
+#include <iostream>
+#include <thread>
+
+#include <boost/program_options.hpp>
+
+#include "output/shm_ring.hpp"
+
+int main(int argc, char *argv[])
+{
+	using namespace boost::program_options;
+
+	std::string ring, output;
+	unsigned int frames;
+	options_description desc("Writes the newest JPEGs from a ring made with rpicam-mjpeg --preview-shm.\n\n"
+							 "Usage: rpicam-mjpeg-ring [options] ring\n\nValid options are");
+	// clang-format off
+	desc.add_options()
+		("help,h", "Print this help message")
+		("ring", value<std::string>(&ring), "The ring file, e.g. /dev/shm/mjpeg/cam.ring")
+		("output,o", value<std::string>(&output)->default_value("-"),
+			"Where to write the JPEGs, - for stdout. A file is rewritten with each frame, while stdout gets a "
+			"stream of them one after the other (which players take as MJPEG)")
+		("frames,n", value<unsigned int>(&frames)->default_value(1),
+			"Number of frames to write, waiting for each new one. 0 carries on until the writer stops")
+		("info", "Print the ring's details and newest frame instead");
+	// clang-format on
+	positional_options_description positional;
+	positional.add("ring", 1);
+
+	try
+	{
+		variables_map vm;
+		store(command_line_parser(argc, argv).options(desc).positional(positional).run(), vm);
+		notify(vm);
+		if (vm.count("help") || ring.empty())
+		{
+			std::cout << desc;
+			return vm.count("help") ? 0 : -1;
+		}
+
+		ShmRingReader reader(ring);
+		ShmRingHeader const &header = reader.Header();
+		if (vm.count("info"))
+		{
+			ShmRingReader::Frame frame;
+			std::cout << ring << ": " << header.num_slots << " slots of " << header.slot_size << " bytes, "
+					  << reader.Sequence() << " frames written, writer " << (reader.Active() ? "running" : "stopped")
+					  << std::endl;
+			if (reader.Newest(frame))
+				std::cout << "Newest frame " << frame.frame << ", " << frame.size << " bytes at "
+						  << frame.timestamp_us << "us" << std::endl;
+			return 0;
+		}
+
+		std::vector<uint8_t> jpeg;
+		uint64_t last = 0;
+		for (unsigned int count = 0; !frames || count < frames;)
+		{
+			uint64_t frame = reader.CopyNewest(jpeg);
+			if (!frame || frame == last)
+			{
+				if (!reader.Active())
+					break;
+				std::this_thread::sleep_for(std::chrono::milliseconds(2));
+				continue;
+			}
+			last = frame;
+			count++;
+
+			FILE *fp = output == "-" ? stdout : fopen(output.c_str(), "wb");
+			if (!fp)
+				throw std::runtime_error("failed to open " + output);
+			bool ok = fwrite(jpeg.data(), jpeg.size(), 1, fp) == 1;
+			ok = (fp == stdout ? fflush(fp) : fclose(fp)) == 0 && ok;
+			if (!ok)
+				throw std::runtime_error("failed to write " + output);
+		}
+	}
+	catch (std::exception const &e)
+	{
+		std::cerr << "ERROR: *** " << e.what() << " ***" << std::endl;
+		return -1;
+	}
+	return 0;
+}
@@ -2,6 +2,7 @@
 
 #include <filesystem>
 #include <functional>
+#include <memory>
 #include <thread>
 #include <vector>
 #include <mutex>
@@ -87,6 +88,19 @@ class ImageSaver {
             std::cout << "Finished saving image at " << std::chrono::duration_cast<std::chrono::milliseconds>(std::chrono::high_resolution_clock::now().time_since_epoch()).count() << std::endl;
         }
 
+        // Save a JPEG already made by the preview encoder, so the image costs no encoding at all.
+        void SaveEncodedImage(std::string const &filename, uint8_t const *jpeg, size_t jpeg_len,
+                              libcamera::ControlList const &metadata)
+        {
+            std::unique_ptr<StillOptions> still_options(options_->GetStillOptions());
+            jpeg_save_encoded(jpeg, jpeg_len, metadata, filename, camera_model_, still_options.get());
+            update_latest_link(filename);
+            options_->framestart++;
+            if (options_->wrap)
+                options_->framestart %= options_->wrap;
+            LOG(2, "Saved preview image to file " << filename);
+        }
+
         void stop()
         {
             for (auto &thread : active_threads_)
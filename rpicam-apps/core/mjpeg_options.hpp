@@ -7,6 +7,8 @@
 
 #include <string>
 #include <ctime>
+#include <sstream>
+#include <vector>
 
 #include "video_still_options.hpp"
 #include "video_options.hpp"
@@ -14,6 +16,16 @@
 #include "core/options.hpp"
 
 
+// An extra size of preview JPEG, written to its own output file. A zero width and height means the
+// preview's own size, and a zero quality the preview's own quality.
+struct PreviewSize
+{
+    unsigned int width;
+    unsigned int height;
+    std::string output;
+    int quality = 0;
+};
+
 struct MJPEGOptions : public VideoStillOptions
 {
     MJPEGOptions() : VideoStillOptions()
@@ -60,17 +72,91 @@ struct MJPEGOptions : public VideoStillOptions
         ("image-no-teardown", value<bool>(&image_no_teardown)->default_value(false)->implicit_value(true),
             "This will force the image stream to run simultaneously with video and lores streams. If --image-stream-type is \"video\" or \"lores\" this flag is enabled by default, and if it is \"still\" this flag cannot be enabled (stream type \"still\" can not run concurrently with video and lores streams and requires camera teardown)")
         ("video-capture-duration,vt", value<unsigned int>(&video_capture_duration)->default_value(0),
-            "NOT WORKING: Sets video capture duration in seconds. If set to 0, video will keep recording until stopped.")
+            "Sets video capture duration in seconds. If set to 0, video will keep recording until stopped.")
         ("video-split-interval,vi", value<unsigned int>(&video_split_interval)->default_value(0),
-            "NOT WORKING: Sets video split interval in seconds. If set to 0, video will not be split.")
+            "Sets video split interval in seconds. If set to 0, video will not be split.")
         ("control-file", value<std::string>(&control_file)->default_value("/var/www/FIFO"),
             "Sets the path to the named pipe for control commands. \"/var/www/FIFO\" is the default path")
         ("fifo-interval", value<unsigned int>(&fifo_interval)->default_value(100000),
-            "Sets the interval in microseconds for the named pipe to be read from")
+            "No longer used, as commands on the named pipe are handled as soon as they arrive. Kept so that existing configuration files still work")
         ("motion-pipe", value<std::string>(&motion_pipe)->default_value("/var/www/FIFO1"),
             "Sets the path to the named pipe for motion detection commands. \"/var/www/FIFO1\" is the default path")
         ("ignore-etc-config", value<bool>(&ignore_etc_config)->default_value(false)->implicit_value(true),
             "Ignore the /etc/rpicam-mjpeg configuration file used by RPi_Cam_Web_Interface. If this flag is not set, the configuration file will be used if it exists. The --config option will override this flag.")
+        ("preview-threads", value<unsigned int>(&preview_threads)->default_value(0),
+            "Number of MJPEG encode threads for the preview stream. If set to 0, this is sized from the online (or --preview-cpus) cores, leaving one core free for the camera")
+        ("preview-cpus", value<std::string>(&preview_cpus),
+            "Restrict the preview encode threads to these CPUs, given as a list such as \"1-3\" or \"2,3\"")
+        ("preview-nice", value<int>(&preview_nice)->default_value(0),
+            "Nice value applied to the preview encode threads")
+        ("preview-sched", value<std::string>(&preview_sched)->default_value("normal"),
+            "Scheduling policy for the preview encode threads. Can be \"normal\", \"batch\" or \"idle\". \"idle\" ensures preview encoding never competes with the camera")
+        ("preview-strips", value<unsigned int>(&preview_strips)->default_value(1),
+            "Split each preview frame into this many horizontal strips which are encoded in parallel, reducing per-frame latency. 0 uses one strip per encode thread, 1 disables strip encoding")
+        ("preview-backend", value<std::string>(&preview_backend)->default_value("libjpeg"),
+            "JPEG library used to encode the preview stream. Can be \"libjpeg\" or, if built with it, \"turbojpeg\", which compresses the YUV planes directly")
+        ("preview-staging", value<bool>(&preview_staging)->default_value(false)->implicit_value(true),
+            "Copy each preview frame into ordinary cached memory before encoding it, so that the camera buffer is handed back straight away and the encoder doesn't read uncached memory")
+        ("preview-http", value<std::string>(&preview_http),
+            "Also serve the preview stream as multipart MJPEG over HTTP on this IPv4 address and port, e.g. 127.0.0.1:8081. Use 0.0.0.0 to listen on every interface")
+        ("preview-socket", value<std::string>(&preview_socket),
+            "Also hand the preview JPEGs to local clients connecting to a Unix domain socket at this path, each frame as a sealed memfd, e.g. /run/rpicam-mjpeg/preview.sock")
+        ("preview-shm", value<std::string>(&preview_shm),
+            "Also publish the preview JPEGs into a ring of slots in this shared memory file, e.g. /dev/shm/mjpeg/cam.ring, from which local readers can take the newest frame without any syscalls")
+        ("preview-shm-slots", value<unsigned int>(&preview_shm_slots)->default_value(4),
+            "Number of frames kept in the --preview-shm ring. A reader has this many frame intervals, less one, to read a frame before it is overwritten")
+        ("preview-shm-slot-size", value<unsigned int>(&preview_shm_slot_size)->default_value(0),
+            "Largest JPEG in bytes that fits in a --preview-shm slot; bigger frames are skipped. 0 uses the preview width times height")
+        ("preview-publish", value<std::string>(&preview_publish)->default_value("rename"),
+            "How each preview JPEG replaces the last one. \"rename\" writes a .tmp file and renames it, while \"tmpfile\" writes an unnamed O_TMPFILE and links it into place")
+        ("preview-sizes", value<std::string>(&preview_sizes_string),
+            "Extra, smaller, sizes of preview JPEG to write from each preview frame, as a comma separated list of <width>x<height>:<path>, e.g. \"160x90:/dev/shm/mjpeg/thumb.jpg\"")
+        ("preview-crop", value<std::string>(&preview_crop)->default_value("0,0,0,0"),
+            "Encode only this region of the preview stream, as fractions of its size, e.g. 0.25,0.25,0.5,0.5. Rounded to multiples of 16 pixels. 0,0,0,0 encodes the whole frame")
+        ("preview-fps", value<float>(&preview_fps)->default_value(0),
+            "Encode the preview stream at this frame rate rather than the camera's, by skipping frames at evenly spaced times. 0 encodes every frame")
+        ("preview-skip-threshold", value<unsigned int>(&preview_skip_threshold)->default_value(0),
+            "Don't encode preview frames whose sampled luma differs from the last encoded frame by no more than this (0-255). 0 encodes every frame")
+        ("preview-refresh-interval", value<unsigned int>(&preview_refresh_interval)->default_value(1000),
+            "With --preview-skip-threshold, still encode a preview frame at least this often, in milliseconds")
+        ("preview-idle-timeout", value<unsigned int>(&preview_idle_timeout)->default_value(0),
+            "Stop encoding the preview when nothing has asked for it for this many milliseconds: no \"pv\" command, no process opening or reading the preview files, and no HTTP or socket clients. Motion detection carries on. 0 always encodes")
+        ("preview-queue-depth", value<unsigned int>(&preview_queue_depth)->default_value(2),
+            "Maximum number of preview frames waiting to be encoded. Further frames are dropped (see --preview-drop-policy) so a slow encode can never stall the camera. 0 means unlimited")
+        ("preview-drop-policy", value<std::string>(&preview_drop_policy)->default_value("oldest"),
+            "Which frame to drop when the preview encode queue is full. Can be \"oldest\" (the newest frame always gets encoded) or \"newest\"")
+        ("preview-grayscale", value<std::string>(&preview_grayscale)->default_value("off"),
+            "Encode the preview stream as grayscale, from the Y plane only. Can be \"off\", \"on\" or \"auto\", which switches to grayscale while the chroma stays flat, as with IR night vision")
+        ("preview-grayscale-threshold", value<unsigned int>(&preview_grayscale_threshold)->default_value(4),
+            "With --preview-grayscale auto, the chroma variance below which a frame counts as colourless")
+        ("preview-huffman-interval", value<unsigned int>(&preview_huffman_interval)->default_value(0),
+            "Encode one preview frame in this many with optimised Huffman tables, and reuse the tables for the frames in between, making them smaller at little extra cost. 0 always uses the standard tables. Not available with --preview-backend turbojpeg")
+        ("preview-target-size", value<unsigned int>(&preview_target_size)->default_value(0),
+            "Adjust the preview quality continually to average this many bytes per frame. 0 disables this")
+        ("preview-target-rate", value<std::string>(&preview_target_rate_string)->default_value("0bps"),
+            "Adjust the preview quality continually to average this bitrate, such as \"4mbps\". If no units are provided, default to bits/second. 0 disables this")
+        ("preview-min-quality", value<int>(&preview_min_quality)->default_value(20),
+            "Lowest quality the preview may be reduced to by --preview-target-size or --preview-target-rate")
+        ("preview-max-quality", value<int>(&preview_max_quality)->default_value(95),
+            "Highest quality the preview may be raised to by --preview-target-size or --preview-target-rate")
+        ("video-threads", value<unsigned int>(&video_threads)->default_value(0),
+            "Number of MJPEG encode threads for the video stream when --codec mjpeg is used. 0 sizes this automatically as for --preview-threads")
+        ("video-cpus", value<std::string>(&video_cpus),
+            "Restrict the video encode threads to these CPUs, as for --preview-cpus")
+        ("video-nice", value<int>(&video_nice)->default_value(0),
+            "Nice value applied to the video encode threads")
+        ("video-sched", value<std::string>(&video_sched)->default_value("normal"),
+            "Scheduling policy for the video encode threads, as for --preview-sched")
+        ("video-strips", value<unsigned int>(&video_strips)->default_value(1),
+            "Number of strips each video frame is encoded as when --codec mjpeg is used, as for --preview-strips")
+        ("video-backend", value<std::string>(&video_backend)->default_value("libjpeg"),
+            "JPEG library used to encode the video stream when --codec mjpeg is used, as for --preview-backend")
+        ("video-staging", value<bool>(&video_staging)->default_value(false)->implicit_value(true),
+            "Stage the video frames when --codec mjpeg is used, as for --preview-staging")
+        ("video-from-preview", value<bool>(&video_from_preview)->default_value(false)->implicit_value(true),
+            "Record video by writing the preview stream's JPEG frames into an AVI or Matroska file (by the --video-output extension, .avi or .mkv) instead of running a video encoder")
+        ("video-preview-quality", value<int>(&video_preview_quality)->default_value(0),
+            "With --video-from-preview, encode the recorded frames again from each preview frame at this quality. 0 records the preview's own frames")
         ;
     }
 
@@ -92,6 +178,71 @@ struct MJPEGOptions : public VideoStillOptions
     unsigned int fifo_interval;
     std::string motion_pipe;
     bool ignore_etc_config;
+    unsigned int preview_threads;
+    std::string preview_cpus;
+    int preview_nice;
+    std::string preview_sched;
+    unsigned int preview_strips;
+    std::string preview_backend;
+    bool preview_staging;
+    std::string preview_http;
+    std::string preview_socket;
+    std::string preview_shm;
+    unsigned int preview_shm_slots;
+    unsigned int preview_shm_slot_size;
+    std::string preview_publish;
+    std::string preview_sizes_string;
+    std::vector<PreviewSize> preview_sizes;
+    std::string preview_crop;
+    float preview_crop_x, preview_crop_y, preview_crop_width, preview_crop_height;
+    float preview_fps;
+    unsigned int preview_skip_threshold;
+    unsigned int preview_refresh_interval;
+    unsigned int preview_idle_timeout;
+    unsigned int preview_queue_depth;
+    std::string preview_drop_policy;
+    std::string preview_grayscale;
+    unsigned int preview_grayscale_threshold;
+    unsigned int preview_huffman_interval;
+    unsigned int preview_target_size;
+    std::string preview_target_rate_string;
+    Bitrate preview_target_rate;
+    int preview_min_quality;
+    int preview_max_quality;
+    unsigned int video_threads;
+    std::string video_cpus;
+    int video_nice;
+    std::string video_sched;
+    unsigned int video_strips;
+    std::string video_backend;
+    bool video_staging;
+    bool video_from_preview;
+    int video_preview_quality;
+
+    // Encode thread settings for the encoder these options are handed to. These are not
+    // command line options, but are filled in from the preview/video ones above when the
+    // per-stream option copies are made.
+    unsigned int encode_threads = 0;
+    std::string encode_cpus;
+    int encode_nice = 0;
+    std::string encode_sched = "normal";
+    unsigned int encode_strips = 1;
+    std::string encode_backend = "libjpeg";
+    bool encode_staging = false;
+    float encode_crop_x = 0;
+    float encode_crop_y = 0;
+    float encode_crop_width = 0;
+    float encode_crop_height = 0;
+    std::vector<PreviewSize> encode_sizes;
+    unsigned int encode_queue_depth = 0;
+    std::string encode_drop_policy = "oldest";
+    std::string encode_grayscale = "off";
+    unsigned int encode_grayscale_threshold = 0;
+    unsigned int encode_huffman_interval = 0;
+    uint64_t encode_target_frame_bytes = 0;
+    uint64_t encode_target_byte_rate = 0;
+    int encode_min_quality = 1;
+    int encode_max_quality = 100;
 
 
     /*
@@ -123,6 +274,39 @@ struct MJPEGOptions : public VideoStillOptions
         if (output_preview.substr(output_preview.size() - 4) != ".tmp")
             output_preview += ".tmp";
 
+        if (preview_publish != "rename" && preview_publish != "tmpfile")
+        {
+            std::cerr << "Invalid preview publish mode: " << preview_publish << std::endl;
+            return false;
+        }
+
+        if (preview_shm_slots < 2)
+        {
+            std::cerr << "The preview shared memory ring needs at least 2 slots" << std::endl;
+            return false;
+        }
+
+        preview_sizes.clear();
+        std::stringstream sizes(preview_sizes_string);
+        std::string size;
+        while (std::getline(sizes, size, ','))
+        {
+            PreviewSize preview_size;
+            char path[256];
+            // The box filter's accumulator limits how far an image can be scaled down.
+            if (sscanf(size.c_str(), "%ux%u:%255s", &preview_size.width, &preview_size.height, path) != 3 ||
+                preview_size.width < 16 || preview_size.height < 16 || (preview_size.width & 1) ||
+                (preview_size.height & 1))
+            {
+                std::cerr << "Invalid preview size: " << size << std::endl;
+                return false;
+            }
+            preview_size.output = path;
+            if (preview_size.output.size() < 4 || preview_size.output.substr(preview_size.output.size() - 4) != ".tmp")
+                preview_size.output += ".tmp";
+            preview_sizes.push_back(preview_size);
+        }
+
 
         if (image_stream_type != "still" && image_stream_type != "raw" && image_stream_type != "video" && image_stream_type != "lores")
         {
@@ -140,6 +324,86 @@ struct MJPEGOptions : public VideoStillOptions
             return false;
         }
 
+        for (std::string const &sched : { preview_sched, video_sched })
+        {
+            if (sched != "normal" && sched != "batch" && sched != "idle")
+            {
+                std::cerr << "Invalid encode scheduling policy: " << sched << std::endl;
+                return false;
+            }
+        }
+
+        for (std::string const &backend : { preview_backend, video_backend })
+        {
+#if TURBOJPEG_PRESENT
+            if (backend != "libjpeg" && backend != "turbojpeg")
+#else
+            if (backend != "libjpeg")
+#endif
+            {
+                std::cerr << "Invalid or unavailable JPEG backend: " << backend << std::endl;
+                return false;
+            }
+        }
+
+        if (preview_huffman_interval && preview_backend == "turbojpeg")
+            std::cerr << "WARNING: --preview-huffman-interval is ignored with the turbojpeg backend" << std::endl;
+
+        if (sscanf(preview_crop.c_str(), "%f,%f,%f,%f", &preview_crop_x, &preview_crop_y, &preview_crop_width,
+                   &preview_crop_height) != 4 ||
+            preview_crop_x < 0 || preview_crop_y < 0 || preview_crop_width < 0 || preview_crop_height < 0 ||
+            preview_crop_x + preview_crop_width > 1 || preview_crop_y + preview_crop_height > 1)
+        {
+            std::cerr << "Invalid preview crop: " << preview_crop << std::endl;
+            return false;
+        }
+
+        if (preview_fps < 0)
+        {
+            std::cerr << "Invalid preview frame rate: " << preview_fps << std::endl;
+            return false;
+        }
+
+        if (preview_drop_policy != "oldest" && preview_drop_policy != "newest")
+        {
+            std::cerr << "Invalid preview drop policy: " << preview_drop_policy << std::endl;
+            return false;
+        }
+
+        if (preview_grayscale != "off" && preview_grayscale != "on" && preview_grayscale != "auto")
+        {
+            std::cerr << "Invalid preview grayscale mode: " << preview_grayscale << std::endl;
+            return false;
+        }
+
+        preview_target_rate.set(preview_target_rate_string);
+        if (preview_target_size && preview_target_rate)
+        {
+            std::cerr << "Only one of --preview-target-size and --preview-target-rate may be given" << std::endl;
+            return false;
+        }
+        if (preview_min_quality < 1 || preview_max_quality > 100 || preview_min_quality > preview_max_quality)
+        {
+            std::cerr << "Invalid preview quality range: " << preview_min_quality << " to " << preview_max_quality
+                      << std::endl;
+            return false;
+        }
+
+        if (video_from_preview)
+        {
+            std::string ext = output_video.size() >= 4 ? output_video.substr(output_video.size() - 4) : "";
+            if (ext != ".avi" && ext != ".mkv")
+            {
+                std::cerr << "--video-from-preview needs a --video-output ending in .avi or .mkv" << std::endl;
+                return false;
+            }
+            if (video_preview_quality < 0 || video_preview_quality > 100)
+            {
+                std::cerr << "Invalid video preview quality: " << video_preview_quality << std::endl;
+                return false;
+            }
+        }
+
         if (fifo_interval <= 0)
         {
             std::cerr << "Invalid FIFO interval" << std::endl;
@@ -186,6 +450,49 @@ struct MJPEGOptions : public VideoStillOptions
         std::cout << "    Motion pipe: " << motion_pipe << std::endl;
         std::cout << "    Ignore /etc/rpicam-mjpeg: " << (ignore_etc_config ? "true" : "false") << std::endl;
         std::cout << "    Config File: " << config_file << std::endl;
+        std::cout << "    Preview threads: " << preview_threads << std::endl;
+        std::cout << "    Preview CPUs: " << preview_cpus << std::endl;
+        std::cout << "    Preview nice: " << preview_nice << std::endl;
+        std::cout << "    Preview sched: " << preview_sched << std::endl;
+        std::cout << "    Preview strips: " << preview_strips << std::endl;
+        std::cout << "    Preview backend: " << preview_backend << std::endl;
+        std::cout << "    Preview staging: " << (preview_staging ? "true" : "false") << std::endl;
+        std::cout << "    Preview publish: " << preview_publish << std::endl;
+        if (!preview_http.empty())
+            std::cout << "    Preview HTTP: " << preview_http << std::endl;
+        if (!preview_socket.empty())
+            std::cout << "    Preview socket: " << preview_socket << std::endl;
+        if (!preview_shm.empty())
+            std::cout << "    Preview shared memory: " << preview_shm << ", " << preview_shm_slots << " slots of "
+                      << preview_shm_slot_size << " bytes" << std::endl;
+        for (auto const &size : preview_sizes)
+            std::cout << "    Preview size: " << size.width << "x" << size.height << " to " << size.output << std::endl;
+        if (preview_crop_width == 0 || preview_crop_height == 0)
+            std::cout << "    Preview crop: all" << std::endl;
+        else
+            std::cout << "    Preview crop: " << preview_crop_x << "," << preview_crop_y << "," << preview_crop_width
+                      << "," << preview_crop_height << std::endl;
+        std::cout << "    Preview fps: " << preview_fps << std::endl;
+        std::cout << "    Preview skip threshold: " << preview_skip_threshold << std::endl;
+        std::cout << "    Preview refresh interval: " << preview_refresh_interval << std::endl;
+        std::cout << "    Preview idle timeout: " << preview_idle_timeout << std::endl;
+        std::cout << "    Preview queue depth: " << preview_queue_depth << std::endl;
+        std::cout << "    Preview drop policy: " << preview_drop_policy << std::endl;
+        std::cout << "    Preview grayscale: " << preview_grayscale << std::endl;
+        std::cout << "    Preview grayscale threshold: " << preview_grayscale_threshold << std::endl;
+        std::cout << "    Preview Huffman interval: " << preview_huffman_interval << std::endl;
+        std::cout << "    Preview target size: " << preview_target_size << std::endl;
+        std::cout << "    Preview target rate: " << preview_target_rate.kbps() << "kbps" << std::endl;
+        std::cout << "    Preview quality range: " << preview_min_quality << " to " << preview_max_quality << std::endl;
+        std::cout << "    Video threads: " << video_threads << std::endl;
+        std::cout << "    Video CPUs: " << video_cpus << std::endl;
+        std::cout << "    Video nice: " << video_nice << std::endl;
+        std::cout << "    Video sched: " << video_sched << std::endl;
+        std::cout << "    Video strips: " << video_strips << std::endl;
+        std::cout << "    Video backend: " << video_backend << std::endl;
+        std::cout << "    Video staging: " << (video_staging ? "true" : "false") << std::endl;
+        std::cout << "    Video from preview: " << (video_from_preview ? "true" : "false") << std::endl;
+        std::cout << "    Video preview quality: " << video_preview_quality << std::endl;
     }
 
     StillOptions* GetStillOptions()
@@ -33,6 +33,9 @@ enum Flag {
     TV, // N * 1/10 seconds between images in timelapse, tv [n]
     VI, // Set video split interval in seconds, vi [n]
     MD, // Set motion detection, md 0/1
+    PF, // Set preview frame rate, pf [n]
+    PC, // Set preview crop, pc x y w h, or pc 0 for the whole frame
+    PV, // Preview viewer heartbeat, pv
     OTHER
 };
 
@@ -54,7 +57,10 @@ std::unordered_map<std::string, Flag> flag_map = {
     {"TL", TL},
     {"TV", TV},
     {"VI", VI},
-    {"MD", MD}
+    {"MD", MD},
+    {"PF", PF},
+    {"PC", PC},
+    {"PV", PV}
 };
 
 bool isFloat(const std::string& s) {
@@ -101,7 +107,9 @@ bool Pipe::openPipe(bool forWriting) {
     if (forWriting)
         flags |= O_WRONLY;
     else
-        flags |= O_RDONLY;
+        // Holding a write end ourselves means there's never a hangup to report when the last writer
+        // closes, so the pipe only becomes readable when there's a command to read.
+        flags |= O_RDWR;
 
     pipeDescriptor = open(pipeName.c_str(), flags);
     if (pipeDescriptor == -1)
@@ -252,6 +260,7 @@ void Pipe::readFIFO(RPiCamMJPEGEncoder *app) {
                 app->SetFifoRequest(FIFORequest::UNKNOWN);
             else
             {
+                app->SetBrightness(std::stof(arg));
                 app->WriteOptionToConfigFile("brightness", arg);
                 std::cout << "Brightness: " << arg << std::endl;
             }
@@ -262,7 +271,10 @@ void Pipe::readFIFO(RPiCamMJPEGEncoder *app) {
             if (!isFloat(arg))
                 app->SetFifoRequest(FIFORequest::UNKNOWN);
             else
+            {
+                app->SetSharpness(std::stof(arg));
                 app->WriteOptionToConfigFile("sharpness", arg);
+            }
             break;
 
         case CO: // contrast
@@ -270,7 +282,10 @@ void Pipe::readFIFO(RPiCamMJPEGEncoder *app) {
             if (!isFloat(arg))
                 app->SetFifoRequest(FIFORequest::UNKNOWN);
             else
+            {
+                app->SetContrast(std::stof(arg));
                 app->WriteOptionToConfigFile("contrast", arg);
+            }
             break;
         
         case SA: // saturation
@@ -278,7 +293,10 @@ void Pipe::readFIFO(RPiCamMJPEGEncoder *app) {
             if (!isFloat(arg))
                 app->SetFifoRequest(FIFORequest::UNKNOWN);
             else
+            {
+                app->SetSaturation(std::stof(arg));
                 app->WriteOptionToConfigFile("saturation", arg);
+            }
             break;
         
         case RO: // rotation
@@ -291,10 +309,13 @@ void Pipe::readFIFO(RPiCamMJPEGEncoder *app) {
         
         case SS: // shutter-speed in microseconds
             ss >> arg;
-            if (!isInteger(arg))
+            if (!isInteger(arg) || arg.size() > 9)
                 app->SetFifoRequest(FIFORequest::UNKNOWN);
             else
+            {
+                app->SetShutter(std::stoi(arg));
                 app->WriteOptionToConfigFile("shutter", arg);
+            }
             break;
 
         case BI: // bitrate in bits per second for h264 encoder
@@ -342,7 +363,7 @@ void Pipe::readFIFO(RPiCamMJPEGEncoder *app) {
                     if (!ss.eof())
                     {
                         ss >> arg;
-                        if (!isInteger(arg))
+                        if (isInteger(arg))
                             app->SetVideoCaptureDuration(std::stoi(arg));
                         else
                             app->SetFifoRequest(FIFORequest::UNKNOWN);
@@ -367,7 +388,7 @@ void Pipe::readFIFO(RPiCamMJPEGEncoder *app) {
         
         case VI: // Set video split interval in seconds, vi [n]
             ss >> arg;
-            if (!isInteger(arg))
+            if (isInteger(arg))
                 app->SetVideoSplitInterval(std::stoi(arg));
             else
                 app->SetFifoRequest(FIFORequest::UNKNOWN);
@@ -391,6 +412,45 @@ void Pipe::readFIFO(RPiCamMJPEGEncoder *app) {
                 app->SetFifoRequest(FIFORequest::UNKNOWN);
             break;
             
+        case PF: // preview frame rate, 0 for every frame
+            ss >> arg;
+            if (!isFloat(arg) || std::stof(arg) < 0)
+                app->SetFifoRequest(FIFORequest::UNKNOWN);
+            else
+            {
+                app->SetPreviewFramerate(std::stof(arg));
+                app->WriteOptionToConfigFile("preview-fps", arg);
+            }
+            break;
+
+        case PC: // preview crop as fractions of the frame, pc x y w h, or pc 0 for the whole frame
+        {
+            std::string args[4];
+            float crop[4] = { 0, 0, 0, 0 };
+            ss >> args[0];
+            if (args[0] != "0")
+            {
+                ss >> args[1] >> args[2] >> args[3];
+                for (int i = 0; i < 4; i++)
+                    crop[i] = isFloat(args[i]) ? std::stof(args[i]) : -1;
+            }
+            if (crop[0] < 0 || crop[1] < 0 || crop[2] < 0 || crop[3] < 0 || crop[0] + crop[2] > 1 ||
+                crop[1] + crop[3] > 1)
+                app->SetFifoRequest(FIFORequest::UNKNOWN);
+            else
+            {
+                app->SetPreviewCrop(crop[0], crop[1], crop[2], crop[3]);
+                std::ostringstream value;
+                value << crop[0] << "," << crop[1] << "," << crop[2] << "," << crop[3];
+                app->WriteOptionToConfigFile("preview-crop", value.str());
+            }
+            break;
+        }
+
+        case PV: // someone is watching the preview, so keep encoding it
+            app->PreviewDemand();
+            break;
+
         default:
             app->SetFifoRequest(FIFORequest::UNKNOWN);
             break;
@@ -34,6 +34,9 @@ public:
 
     void readFIFO(RPiCamMJPEGEncoder *app);
 
+    // The file descriptor to wait on for data, or -1 if the pipe isn't open
+    int fd() const { return isOpen ? pipeDescriptor : -1; }
+
 private:
     std::string pipeName;
     int pipeDescriptor; // File descriptor for the pipe
@@ -818,6 +818,11 @@ RPiCamApp::Msg RPiCamApp::Wait()
 	return msg_queue_.Wait();
 }
 
+std::optional<RPiCamApp::Msg> RPiCamApp::TryWait()
+{
+	return msg_queue_.TryWait();
+}
+
 void RPiCamApp::queueRequest(CompletedRequest *completed_request)
 {
 	BufferMap buffers(std::move(completed_request->buffers));
@@ -7,12 +7,15 @@
 
 #pragma once
 
+#include <sys/eventfd.h>
 #include <sys/mman.h>
+#include <unistd.h>
 
 #include <condition_variable>
 #include <iostream>
 #include <memory>
 #include <mutex>
+#include <optional>
 #include <queue>
 #include <set>
 #include <sstream>
@@ -144,6 +147,9 @@ public:
 	void StopCamera();
 
 	Msg Wait();
+	// Returns a message if there is one, without waiting. MessageFd() becomes readable when one is posted.
+	std::optional<Msg> TryWait();
+	int MessageFd() const { return msg_queue_.Fd(); }
 	void PostMessage(MsgType &t, MsgPayload &p);
 
 	Stream *GetStream(std::string const &name, StreamInfo *info = nullptr) const;
@@ -198,12 +204,18 @@ protected:
 	class MessageQueue
 	{
 	public:
+		MessageQueue() : event_fd_(eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC)) {}
+		~MessageQueue() { close(event_fd_); }
 		template <typename U>
 		void Post(U &&msg)
 		{
-			std::unique_lock<std::mutex> lock(mutex_);
-			queue_.push(std::forward<U>(msg));
-			cond_.notify_one();
+			{
+				std::unique_lock<std::mutex> lock(mutex_);
+				queue_.push(std::forward<U>(msg));
+				cond_.notify_one();
+			}
+			uint64_t value = 1;
+			[[maybe_unused]] ssize_t ret = write(event_fd_, &value, sizeof(value));
 		}
 		T Wait()
 		{
@@ -213,16 +225,29 @@ protected:
 			queue_.pop();
 			return msg;
 		}
+		std::optional<T> TryWait()
+		{
+			std::unique_lock<std::mutex> lock(mutex_);
+			if (queue_.empty())
+				return std::nullopt;
+			T msg = std::move(queue_.front());
+			queue_.pop();
+			return msg;
+		}
 		void Clear()
 		{
 			std::unique_lock<std::mutex> lock(mutex_);
 			queue_ = {};
 		}
+		// Becomes readable when a message is posted, for waiting on in poll or epoll. Read it to clear it
+		// before calling TryWait() until there are no more messages.
+		int Fd() const { return event_fd_; }
 
 	private:
 		std::queue<T> queue_;
 		std::mutex mutex_;
 		std::condition_variable cond_;
+		int event_fd_;
 	};
 	struct PreviewItem
 	{
@@ -8,6 +8,8 @@
 #pragma once
 #include "core/pipe.hpp"
 
+#include <algorithm>
+#include <deque>
 #include <string>
 #include <filesystem>
 #include <chrono>
@@ -17,7 +19,9 @@
 #include <time.h>
 #include <ctime>
 
+#include <sys/inotify.h>
 #include <sys/stat.h>
+#include <unistd.h>
 
 #include "core/rpicam_app.hpp"
 #include "core/stream_info.hpp"
@@ -25,6 +29,7 @@
 #include "core/image_saver.hpp"
 
 #include "encoder/encoder.hpp"
+#include "encoder/mjpeg_encoder.hpp"
 
 #define MAX_UNSIGNED_INT_LENGTH 10 // 4,294,967,295
 #define NULL_TERMINATOR_LENGTH 1
@@ -52,6 +57,17 @@ public:
 	using FrameBuffer = libcamera::FrameBuffer;
 
 	RPiCamMJPEGEncoder() : RPiCamApp(std::make_unique<MJPEGOptions>()) {}
+	~RPiCamMJPEGEncoder()
+	{
+		// Finish writing the config file, which a restart is about to read.
+		{
+			std::lock_guard<std::mutex> lock(config_mutex_);
+			config_abort_ = true;
+			config_cond_.notify_one();
+		}
+		if (config_thread_.joinable())
+			config_thread_.join();
+	}
 
 	void ConfigureMJPEGImageStill(unsigned int flags = FLAG_STILL_NONE)
 	{
@@ -201,6 +217,12 @@ public:
 		if (lores_size.width > configuration_->at(0).size.width ||
 			lores_size.height > configuration_->at(0).size.height)
 			throw std::runtime_error("Low resolution stream larger than video");
+		for (auto const &size : options->preview_sizes)
+		{
+			if (size.width > lores_size.width || size.height > lores_size.height)
+				throw std::runtime_error("Preview size " + std::to_string(size.width) + "x" +
+										 std::to_string(size.height) + " larger than low resolution stream");
+		}
 		configuration_->at(1).pixelFormat = lores_format_;
 		configuration_->at(1).size = lores_size;
 		configuration_->at(1).bufferCount = configuration_->at(0).bufferCount;
@@ -304,6 +326,16 @@ public:
 
 	void StartVideoEncoder()
 	{
+		if (GetOptions()->video_from_preview)
+		{
+			// There's no encoder, the preview encoder's output is simply passed on to the video output.
+			MJPEGOptions *video_options(GetVideoOptions());
+			makeFilename(&(video_options->output), video_options->output_video);
+			createParentPath(video_options->output);
+			setRecordingFromPreview(true);
+			video_outputting_ = true;
+			return;
+		}
 		createVideoEncoder();
 		video_encoder_->SetInputDoneCallback(std::bind(&RPiCamMJPEGEncoder::videoEncodeBufferDone, this, std::placeholders::_1));
 		video_encoder_->SetOutputReadyCallback(video_encode_output_ready_callback_);
@@ -312,10 +344,28 @@ public:
 
 	void StartLoresEncoder()
 	{
+		lores_signature_.clear();
+		next_lores_frame_ns_ = last_lores_frame_ns_ = 0;
 		createParentPath(GetLoresOptions()->output);
+		for (auto const &size_options : preview_size_options_)
+			createParentPath(size_options->output);
 		createLoresEncoder();
+		startPreviewWatch();
 		lores_encoder_->SetInputDoneCallback(std::bind(&RPiCamMJPEGEncoder::loresEncodeBufferDone, this, std::placeholders::_1));
-		lores_encoder_->SetOutputReadyCallback(lores_encode_output_ready_callback_);
+		lores_encoder_->SetOutputReadyCallback(std::bind(&RPiCamMJPEGEncoder::loresEncodeOutputReady, this,
+														 std::placeholders::_1, std::placeholders::_2,
+														 std::placeholders::_3, std::placeholders::_4));
+		// The lores stream always uses the MJPEG encoder, which makes the extra preview sizes.
+		MjpegEncoder *mjpeg_encoder = dynamic_cast<MjpegEncoder *>(lores_encoder_.get());
+		for (unsigned int i = 0; mjpeg_encoder && i < lores_size_output_ready_callbacks_.size(); i++)
+			mjpeg_encoder->SetSizeOutputReadyCallback(i, lores_size_output_ready_callbacks_[i]);
+		if (mjpeg_encoder && record_size_ >= 0)
+		{
+			mjpeg_encoder->SetSizeOutputReadyCallback(
+				record_size_, std::bind(&RPiCamMJPEGEncoder::recordOutputReady, this, std::placeholders::_1,
+										std::placeholders::_2, std::placeholders::_3, std::placeholders::_4));
+			mjpeg_encoder->SetSizeEnabled(record_size_, recording_from_preview_);
+		}
 		lores_outputting_ = true;
 	}
 
@@ -328,11 +378,14 @@ public:
 	// This is callback when the encoder gives you the encoded output data.
 	void SetVideoEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { video_encode_output_ready_callback_ = callback; }
 	void SetLoresEncodeOutputReadyCallback(EncodeOutputReadyCallback callback) { lores_encode_output_ready_callback_ = callback; }
+	void SetLoresSizeOutputReadyCallbacks(std::vector<EncodeOutputReadyCallback> callbacks) { lores_size_output_ready_callbacks_ = callbacks; }
 	void SetVideoMetadataReadyCallback(MetadataReadyCallback callback) { video_metadata_ready_callback_ = callback; };
 	void SetLoresMetadataReadyCallback(MetadataReadyCallback callback) { lores_metadata_ready_callback_ = callback; };
 
 	void VideoEncodeBuffer(CompletedRequestPtr &completed_request, Stream *stream)
 	{
+		if (recording_from_preview_)
+			return;
 		assert(video_encoder_);
 		StreamInfo info = GetStreamInfo(stream);
 		FrameBuffer *buffer = completed_request->buffers[stream];
@@ -345,7 +398,7 @@ public:
 		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			video_buffer_queue_.emplace_back(mem, completed_request); // creates a new reference
 		}
 		video_encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 	}
@@ -355,16 +408,30 @@ public:
 		assert(lores_encoder_);
 		StreamInfo info = GetStreamInfo(stream);
 		FrameBuffer *buffer = completed_request->buffers[stream];
+		if (!buffer)
+			throw std::runtime_error("no buffer to encode");
+		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
+		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		// Frames we don't want are let go before we even touch the buffer, unless an image is to be
+		// taken from this one.
+		bool capture = previewCapturePending();
+		if (!previewWanted() && !capture)
+			return;
+		if (!loresFrameDue(timestamp_ns) && !capture)
+			return;
 		BufferReadSync r(this, buffer);
 		libcamera::Span span = r.Get()[0];
 		void *mem = span.data();
-		if (!buffer || !mem)
+		if (!mem)
 			throw std::runtime_error("no buffer to encode");
-		auto ts = completed_request->metadata.get(controls::SensorTimestamp);
-		int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+		if (!loresFrameChanged(completed_request, (uint8_t const *)mem, info, timestamp_ns) && !capture)
+		{
+			LOG(2, "Preview frame unchanged, not encoding");
+			return;
+		}
 		{
 			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			encode_buffer_queue_.push(completed_request); // creates a new reference
+			lores_buffer_queue_.emplace_back(mem, completed_request); // creates a new reference
 		}
 		lores_encoder_->EncodeBuffer(buffer->planes()[0].fd.get(), span.size(), mem, info, timestamp_ns / 1000);
 	}
@@ -373,15 +440,31 @@ public:
 	{
 		StreamInfo info = GetStreamInfo(stream);
 		FrameBuffer *buffer = completed_request->buffers[stream];
-		BufferReadSync r(this, buffer);
-		const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
-		if (!buffer || mem.empty())
+		if (!buffer)
 			throw std::runtime_error("no buffer to encode");
 
 		MJPEGOptions *image_options = (MJPEGOptions* ) GetImageOptions();
 
 		makeFilename(&(image_options->output), image_options->output_image);
-		image_saver_->SaveImage(mem, completed_request, info);
+		if (canCaptureFromPreview(stream))
+		{
+			// The preview encoder is about to compress this very buffer, so the image is simply
+			// written out from its output (in loresEncodeOutputReady), not encoded all over again.
+			auto ts = completed_request->metadata.get(controls::SensorTimestamp);
+			int64_t timestamp_ns = ts ? *ts : buffer->metadata().timestamp;
+			std::lock_guard<std::mutex> lock(preview_capture_mutex_);
+			preview_capture_ = std::make_unique<PreviewCapture>(
+				PreviewCapture{ image_options->output, timestamp_ns / 1000, completed_request->metadata });
+			LOG(2, "Image will be taken from the preview stream");
+		}
+		else
+		{
+			BufferReadSync r(this, buffer);
+			const std::vector<libcamera::Span<uint8_t>> mem = r.Get();
+			if (mem.empty())
+				throw std::runtime_error("no buffer to encode");
+			image_saver_->SaveImage(mem, completed_request, info);
+		}
 
 		image_count++;
 		image_requested_ = false;
@@ -407,6 +490,14 @@ public:
 	MJPEGOptions *GetVideoOptions() { return static_cast<MJPEGOptions *>(video_options_.get()); ;}
 	MJPEGOptions *GetLoresOptions() const { return static_cast<MJPEGOptions *>(lores_options_.get()); ;}
 	MJPEGOptions *GetLoresOptions() { return static_cast<MJPEGOptions *>(lores_options_.get()); ;}
+	// Options for the outputs of each extra preview size, which differ from the lores ones only in the output path.
+	std::vector<std::unique_ptr<MJPEGOptions>> const &GetPreviewSizeOptions() const { return preview_size_options_; }
+	// Options for the HTTP preview stream output, or null when there isn't one.
+	MJPEGOptions const *GetPreviewHttpOptions() const { return preview_http_options_.get(); }
+	// Options for the Unix socket output, or null when there isn't one.
+	MJPEGOptions const *GetPreviewSocketOptions() const { return preview_socket_options_.get(); }
+	// Options for the shared memory ring output, or null when there isn't one.
+	MJPEGOptions const *GetPreviewShmOptions() const { return preview_shm_options_.get(); }
 	MJPEGOptions *GetImageOptions() const { return static_cast<MJPEGOptions *>(image_options_.get()); ;}
 	MJPEGOptions *GetImageOptions() { return static_cast<MJPEGOptions *>(image_options_.get()); ;}
 
@@ -420,17 +511,23 @@ public:
 	{ 
 		video_count++;
 		SaveCount();
+		setRecordingFromPreview(false);
 		video_encoder_.reset(); 
 		video_outputting_ = false;
 	}
 	void StopLoresEncoder()
 	{ 
 		lores_encoder_.reset(); 
+		stopPreviewWatch();
 		lores_outputting_ = false;
 	}
 	void StopImageSaver()
 	{
 		SaveCount();
+		std::lock_guard<std::mutex> lock(preview_capture_mutex_);
+		if (preview_capture_)
+			LOG_ERROR("WARNING: image " << preview_capture_->filename << " not saved, preview stopped first");
+		preview_capture_.reset();
 		image_saver_->stop();
 		image_saver_.reset();
 		image_saver_started_ = false;
@@ -450,14 +547,94 @@ public:
 		lores_options_->segment = 1;
 		lores_options_->width = options->lores_width;
 		lores_options_->height = options->lores_height;
+		lores_options_->encode_threads = options->preview_threads;
+		lores_options_->encode_cpus = options->preview_cpus;
+		lores_options_->encode_nice = options->preview_nice;
+		lores_options_->encode_sched = options->preview_sched;
+		lores_options_->encode_strips = options->preview_strips;
+		lores_options_->encode_backend = options->preview_backend;
+		lores_options_->encode_staging = options->preview_staging;
+		lores_options_->encode_crop_x = options->preview_crop_x;
+		lores_options_->encode_crop_y = options->preview_crop_y;
+		lores_options_->encode_crop_width = options->preview_crop_width;
+		lores_options_->encode_crop_height = options->preview_crop_height;
+		lores_options_->encode_queue_depth = options->preview_queue_depth;
+		lores_options_->encode_drop_policy = options->preview_drop_policy;
+		lores_options_->encode_sizes = options->preview_sizes;
+		preview_fps_ = options->preview_fps;
+		lores_options_->encode_grayscale = options->preview_grayscale;
+		lores_options_->encode_grayscale_threshold = options->preview_grayscale_threshold;
+		lores_options_->encode_huffman_interval = options->preview_huffman_interval;
+		lores_options_->encode_target_frame_bytes = options->preview_target_size;
+		lores_options_->encode_target_byte_rate = options->preview_target_rate.bps() / 8;
+		lores_options_->encode_min_quality = options->preview_min_quality;
+		lores_options_->encode_max_quality = options->preview_max_quality;
+		preview_size_options_.clear();
+		for (auto const &size : options->preview_sizes)
+		{
+			preview_size_options_.push_back(std::make_unique<MJPEGOptions>(*lores_options_));
+			preview_size_options_.back()->output = size.output;
+			preview_size_options_.back()->width = size.width;
+			preview_size_options_.back()->height = size.height;
+			// These outputs don't get metadata or timestamps passed to them.
+			preview_size_options_.back()->metadata.clear();
+			preview_size_options_.back()->save_pts.clear();
+		}
+		preview_http_options_.reset();
+		if (!options->preview_http.empty())
+		{
+			preview_http_options_ = std::make_unique<MJPEGOptions>(*lores_options_);
+			preview_http_options_->output = "http://" + options->preview_http;
+			preview_http_options_->metadata.clear();
+			preview_http_options_->save_pts.clear();
+		}
+		preview_socket_options_.reset();
+		if (!options->preview_socket.empty())
+		{
+			preview_socket_options_ = std::make_unique<MJPEGOptions>(*lores_options_);
+			preview_socket_options_->output = options->preview_socket;
+			preview_socket_options_->metadata.clear();
+			preview_socket_options_->save_pts.clear();
+		}
+		preview_shm_options_.reset();
+		if (!options->preview_shm.empty())
+		{
+			preview_shm_options_ = std::make_unique<MJPEGOptions>(*lores_options_);
+			preview_shm_options_->output = options->preview_shm;
+			preview_shm_options_->metadata.clear();
+			preview_shm_options_->save_pts.clear();
+			if (!preview_shm_options_->preview_shm_slot_size)
+				preview_shm_options_->preview_shm_slot_size = options->lores_width * options->lores_height;
+		}
+
+		video_options_->encode_threads = options->video_threads;
+		video_options_->encode_cpus = options->video_cpus;
+		video_options_->encode_nice = options->video_nice;
+		video_options_->encode_sched = options->video_sched;
+		video_options_->encode_strips = options->video_strips;
+		video_options_->encode_backend = options->video_backend;
+		video_options_->encode_staging = options->video_staging;
+		record_size_ = -1;
+		if (options->video_from_preview)
+		{
+			// The recorded frames have no metadata to go with them.
+			video_options_->metadata.clear();
+			// A different quality needs the preview frames encoding again, which is done as an extra
+			// preview size, the same size as the preview itself.
+			if (options->video_preview_quality)
+			{
+				record_size_ = lores_options_->encode_sizes.size();
+				lores_options_->encode_sizes.push_back({ 0, 0, "", options->video_preview_quality });
+			}
+		}
 
 		image_options_->quality = options->image_quality;
 		image_options_->width = options->image_width;
 		image_options_->height = options->image_height;
 		image_options_->buffer_count = 1;
 
-		SetVideoCaptureDuration(options->video_capture_duration * 1000);
-		SetVideoSplitInterval(options->video_split_interval * 1000);
+		SetVideoCaptureDuration(options->video_capture_duration);
+		SetVideoSplitInterval(options->video_split_interval);
 	}
 
 	void ResetConfiguration()
@@ -477,15 +654,17 @@ public:
 		// motion_pipe->openPipe(true);
 	}
 
+	// Readable when there's a command waiting in the control pipe.
+	int ControlFIFOFd() const { return control_pipe_ ? control_pipe_->fd() : -1; }
+
 	void ReadControlFIFO()
 	{
 		last_fifo_read_time = std::chrono::high_resolution_clock::now();
 		control_pipe_->readFIFO(this);
 	}
 
-	void MoveTempMJPEGOutput()
+	void MoveTempMJPEGOutput(std::string const &mjpeg_output)
 	{
-		std::string mjpeg_output = GetOptions()->output_preview;
 		// create a new string, preview_output, that is the same as mjpeg_output but with the .tmp extension removed
 		std::string preview_output = mjpeg_output.substr(0, mjpeg_output.size() - 4);
 		// if the .tmp file exists, rename it to remove the .tmp extension, overwriting the existing file
@@ -510,7 +689,9 @@ public:
 		return true;
 	}
 
-	void WriteOptionToConfigFile(std::string command, std::string args) 
+	// Save an option to the config file, so that it's used when we next start. The file is written by a
+	// thread of its own, so that commands take effect without waiting for it.
+	void WriteOptionToConfigFile(std::string command, std::string args)
 	{
 		if (GetOptions()->config_file.empty())
 		{
@@ -518,84 +699,79 @@ public:
 			return;
 		}
 
-		std::filesystem::path config_path = GetOptions()->config_file;
-		if (!CreateConfigFile(config_path))
-		{
-			LOG(2, "Failed to create " << config_path);
-			return;
-		}
-		// Check for flags
-		std::ifstream mjpeg_config_file(config_path);
-    
-		if (!mjpeg_config_file.is_open()) {
-			std::cerr << "Error opening file: " << config_path << std::endl;
-			return;
-		}
-		std::string line;
-		std::stringstream fileContent;
-		bool commandFound = false;
-
-		// check if the command is already in the file
-		while (std::getline(mjpeg_config_file, line)) {
-
-			if (line.rfind(command, 0) == 0) { 
-				line = command + "=" + args;
-				commandFound = true;
-			}
-			fileContent << line << "\n";
-		}
-		mjpeg_config_file.close();
+		std::lock_guard<std::mutex> lock(config_mutex_);
+		if (!config_thread_.joinable())
+			config_thread_ = std::thread(&RPiCamMJPEGEncoder::configThread, this);
+		// Only the latest value of an option still waiting to be written matters.
+		auto it = std::find_if(config_queue_.begin(), config_queue_.end(),
+							   [&command](ConfigWrite const &write) { return write.command == command; });
+		if (it != config_queue_.end())
+			it->args = args;
+		else
+			config_queue_.push_back({ GetOptions()->config_file, command, args });
+		config_cond_.notify_one();
+	}
 
+	// void WriteOptionsToConfigFile()
+	// {
 
-		// Split into two cases: command found and command not found
+	// }
 
-		// COMMAND NOT FOUND
-		if (!commandFound) {
-			std::ofstream mjpeg_config_file_out(config_path, std::ios::app);
-			if (!mjpeg_config_file_out.is_open()) {
-				std::cerr << "Error opening file: " << config_path << std::endl;
-				return;
-			}
-			// std::cout << "fileContent: " << fileContent.str() << std::endl;
-			std::cout << "Command not found in the file." << std::endl;
-			// Append the line.
-			mjpeg_config_file_out << command << "=" << args << "\n";
-			mjpeg_config_file_out.close();
+	// Change the preview frame rate on the fly. 0 encodes every frame.
+	void SetPreviewFramerate(float fps)
+	{
+		preview_fps_ = fps;
+		next_lores_frame_ns_ = 0;
+		LOG(2, "Preview frame rate now " << fps);
+	}
 
-			// std::this_thread::sleep_for(std::chrono::seconds(10)); // Sleep for 1 second
-		}
-		// COMMAND FOUND
-		else {
-			LOG(2, "Command found in file:  " << command << "=" << args);
-			// std::cout << fileContent.str() << std::endl;
-			// Edit the line.
-			std::ifstream mjpeg_config_file_in(config_path);
-			while (std::getline(mjpeg_config_file_in, line)) {
-				// Check if the line starts with the option
-				if (line.find(command) == 0) {
-					// Replace the line with the new value
-					line = command + "=" + args;
-					LOG(2, "line: " << line);
-					commandFound = true;
-				}
-			mjpeg_config_file_in.close();
-			std::ofstream mjpeg_config_file_out(config_path, std::ios::trunc);
-			if (!mjpeg_config_file_out.is_open()) {
-				std::cerr << "Error opening file: " << config_path << std::endl;
-				return;
-			}
-			mjpeg_config_file_out << fileContent.str();
-			// mjpeg_config_file_out << line << std::endl;  // Write the line (modified or not) to the output file
-			mjpeg_config_file_out.close();
-			}
-			// std::this_thread::sleep_for(std::chrono::seconds(10)); // Sleep for 1 second
-		}
+	// Image controls changed while running go to the camera with the next request, so nothing needs
+	// restarting. They're kept in the options too, from which they're set whenever the camera starts.
+	void SetBrightness(float brightness)
+	{
+		GetOptions()->brightness = brightness;
+		setControl(libcamera::controls::Brightness, brightness);
+	}
+	void SetContrast(float contrast)
+	{
+		GetOptions()->contrast = contrast;
+		setControl(libcamera::controls::Contrast, contrast);
+	}
+	void SetSaturation(float saturation)
+	{
+		GetOptions()->saturation = saturation;
+		setControl(libcamera::controls::Saturation, saturation);
+	}
+	void SetSharpness(float sharpness)
+	{
+		GetOptions()->sharpness = sharpness;
+		setControl(libcamera::controls::Sharpness, sharpness);
+	}
+	// In microseconds, 0 meaning automatic.
+	void SetShutter(int32_t shutter_us)
+	{
+		GetOptions()->shutter.value = std::chrono::microseconds(shutter_us);
+		setControl(libcamera::controls::ExposureTime, shutter_us);
 	}
 
-	// void WriteOptionsToConfigFile()
-	// {
+	// Something wants to see the preview, so encode it for at least another --preview-idle-timeout.
+	void PreviewDemand() { last_preview_demand_ = std::chrono::steady_clock::now(); }
+	// Says whether any clients are watching the preview through an output other than its files.
+	void SetPreviewClientsCallback(std::function<bool()> callback) { preview_clients_callback_ = callback; }
 
-	// }
+	// Change the part of the preview frame that gets encoded on the fly, as fractions of the frame
+	// size. A zero width or height encodes the whole frame again.
+	void SetPreviewCrop(float x, float y, float width, float height)
+	{
+		lores_options_->encode_crop_x = x;
+		lores_options_->encode_crop_y = y;
+		lores_options_->encode_crop_width = width;
+		lores_options_->encode_crop_height = height;
+		MjpegEncoder *mjpeg_encoder = dynamic_cast<MjpegEncoder *>(lores_encoder_.get());
+		if (mjpeg_encoder)
+			mjpeg_encoder->SetCrop(x, y, width, height);
+		LOG(2, "Preview crop now " << x << "," << y << "," << width << "," << height);
+	}
 
 	void SetFifoRequest(FIFORequest request) { fifo_request_ = request; }
 	FIFORequest GetFifoRequest() const { return fifo_request_; }
@@ -609,6 +785,7 @@ public:
 
 	// set time of video capture, video capture timeout duration, time of last video segment, and video segment duration
 	void UpdateLastVideoCaptureTime() { last_video_capture_time = std::chrono::high_resolution_clock::now(); }
+	// Both in seconds, 0 meaning never.
 	void SetVideoCaptureDuration(double timeout) { video_capture_duration = std::chrono::duration<double>(timeout); }
 	void UpdateLastVideoSplitTime() { last_video_split_time = std::chrono::high_resolution_clock::now(); }
 	void SetVideoSplitInterval(double duration) { video_split_interval = std::chrono::duration<double>(duration); }
@@ -671,6 +848,10 @@ protected:
 
 	std::unique_ptr<MJPEGOptions> video_options_;
 	std::unique_ptr<MJPEGOptions> lores_options_;
+	std::vector<std::unique_ptr<MJPEGOptions>> preview_size_options_;
+	std::unique_ptr<MJPEGOptions> preview_http_options_;
+	std::unique_ptr<MJPEGOptions> preview_socket_options_;
+	std::unique_ptr<MJPEGOptions> preview_shm_options_;
 	std::unique_ptr<MJPEGOptions> image_options_;
 
 	FIFORequest fifo_request_ = NONE;
@@ -679,45 +860,407 @@ protected:
 	std::unique_ptr<Pipe> control_pipe_;
 	// std::unique_ptr<Pipe> motion_pipe; 
 private:
-	void videoEncodeBufferDone(void *mem)
+	// Lores image captures can come straight from the preview encoder when it makes exactly the JPEG
+	// that saving the image would. Lores images are never cropped, so nor must the preview be.
+	bool canCaptureFromPreview(Stream *stream)
+	{
+		MJPEGOptions const *options = GetOptions();
+		MJPEGOptions const *image_options = GetImageOptions();
+		return stream == LoresStream() && lores_outputting_ && image_options->encoding == "jpg" &&
+			   image_options->quality == GetLoresOptions()->quality && !options->preview_target_size &&
+			   !options->preview_target_rate && options->preview_grayscale == "off" &&
+			   (GetLoresOptions()->encode_crop_width == 0 || GetLoresOptions()->encode_crop_height == 0);
+	}
+
+	bool previewCapturePending()
+	{
+		std::lock_guard<std::mutex> lock(preview_capture_mutex_);
+		return !!preview_capture_;
+	}
+
+	// Runs in the lores encoder's output thread, which saves any waiting image from the first preview
+	// frame at or after the request it was made on.
+	void loresEncodeOutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (video_metadata_ready_callback_ && !GetOptions()->metadata.empty())
-				video_metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			std::lock_guard<std::mutex> lock(preview_capture_mutex_);
+			if (preview_capture_ && timestamp_us >= preview_capture_->timestamp_us && image_saver_)
+			{
+				try
+				{
+					image_saver_->SaveEncodedImage(preview_capture_->filename, (uint8_t const *)mem, size,
+												   preview_capture_->metadata);
+				}
+				catch (std::exception const &e)
+				{
+					LOG_ERROR("ERROR: failed to save image " << preview_capture_->filename << ": " << e.what());
+				}
+				preview_capture_.reset();
+			}
 		}
+		if (lores_encode_output_ready_callback_)
+			lores_encode_output_ready_callback_(mem, size, timestamp_us, keyframe);
+		if (record_size_ < 0)
+			recordOutputReady(mem, size, timestamp_us, keyframe);
 	}
-	void loresEncodeBufferDone(void *mem)
+
+	// Recording from the preview stream means handing the video output the preview encoder's frames,
+	// or those of the extra size made for it. These arrive in the preview encoder's output thread.
+	void setRecordingFromPreview(bool recording)
 	{
-		// If non-NULL, mem would indicate which buffer has been completed, but
-		// currently we're just assuming everything is done in order. (We could
-		// handle this by replacing the queue with a vector of <mem, completed_request>
-		// pairs.)
-		assert(mem == nullptr);
+		if (!GetOptions()->video_from_preview)
+			return;
 		{
-			std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
-			if (encode_buffer_queue_.empty())
-				throw std::runtime_error("no buffer available to return");
-			CompletedRequestPtr &completed_request = encode_buffer_queue_.front();
-			if (lores_metadata_ready_callback_ && !GetOptions()->metadata.empty())
-				lores_metadata_ready_callback_(completed_request->metadata);
-			encode_buffer_queue_.pop(); // drop shared_ptr reference
+			std::lock_guard<std::mutex> lock(record_mutex_);
+			recording_from_preview_ = recording;
 		}
+		MjpegEncoder *mjpeg_encoder = dynamic_cast<MjpegEncoder *>(lores_encoder_.get());
+		if (mjpeg_encoder && record_size_ >= 0)
+			mjpeg_encoder->SetSizeEnabled(record_size_, recording);
+		LOG(2, (recording ? "Started" : "Stopped") << " recording from the preview stream");
+	}
+
+	void recordOutputReady(void *mem, size_t size, int64_t timestamp_us, bool keyframe)
+	{
+		std::lock_guard<std::mutex> lock(record_mutex_);
+		if (recording_from_preview_ && video_encode_output_ready_callback_)
+			video_encode_output_ready_callback_(mem, size, timestamp_us, keyframe);
+	}
+
+	std::mutex record_mutex_;
+	bool recording_from_preview_ = false;
+	// Index of the extra preview size made for recording, if there is one.
+	int record_size_ = -1;
+
+	struct PreviewCapture
+	{
+		std::string filename;
+		int64_t timestamp_us;
+		libcamera::ControlList metadata;
+	};
+	std::mutex preview_capture_mutex_;
+	std::unique_ptr<PreviewCapture> preview_capture_;
+
+	// Pick out the preview frames to encode at the requested rate. We keep to a fixed schedule,
+	// taking the first frame that arrives within half a sensor frame of each due time, so the
+	// chosen frames stay as evenly spaced as the sensor rate allows.
+	bool loresFrameDue(int64_t timestamp_ns)
+	{
+		int64_t frame_interval_ns = last_lores_frame_ns_ ? timestamp_ns - last_lores_frame_ns_ : 0;
+		last_lores_frame_ns_ = timestamp_ns;
+		if (preview_fps_ <= 0)
+			return true;
+
+		int64_t interval_ns = 1e9 / preview_fps_;
+		if (timestamp_ns < next_lores_frame_ns_ - frame_interval_ns / 2)
+		{
+			LOG(2, "Preview frame not due, not encoding");
+			return false;
+		}
+		// Start the schedule again if we've fallen behind it, such as after a restart.
+		next_lores_frame_ns_ += interval_ns;
+		if (next_lores_frame_ns_ <= timestamp_ns)
+			next_lores_frame_ns_ = timestamp_ns + interval_ns;
+		return true;
+	}
+	float preview_fps_ = 0;
+	int64_t next_lores_frame_ns_ = 0;
+	int64_t last_lores_frame_ns_ = 0;
+
+	// Decide whether a preview frame differs enough from the last one we encoded to be worth
+	// encoding. Each frame is summarised by the mean luma of a grid of blocks, sampling only every
+	// 4th pixel of every 4th row, which costs next to nothing even on a Pi Zero. The frame counts
+	// as changed if any block has moved by more than the threshold, if a motion detection stage
+	// reports motion, or if the refresh interval has passed. Every frame counts as changed while
+	// recording from the preview, as the recording needs them all to keep its timing.
+	bool loresFrameChanged(CompletedRequestPtr &completed_request, uint8_t const *mem, StreamInfo const &info,
+						   int64_t timestamp_ns)
+	{
+		MJPEGOptions const *options = GetOptions();
+		if (!options->preview_skip_threshold || recording_from_preview_)
+			return true;
+
+		constexpr unsigned int GRID_W = 16, GRID_H = 12, STEP = 4;
+		std::vector<uint16_t> signature(GRID_W * GRID_H);
+		for (unsigned int gy = 0; gy < GRID_H; gy++)
+		{
+			unsigned int y0 = gy * info.height / GRID_H, y1 = (gy + 1) * info.height / GRID_H;
+			for (unsigned int gx = 0; gx < GRID_W; gx++)
+			{
+				unsigned int x0 = gx * info.width / GRID_W, x1 = (gx + 1) * info.width / GRID_W;
+				unsigned int sum = 0, count = 0;
+				for (unsigned int y = y0; y < y1; y += STEP)
+				{
+					uint8_t const *row = mem + y * info.stride;
+					for (unsigned int x = x0; x < x1; x += STEP, count++)
+						sum += row[x];
+				}
+				signature[gy * GRID_W + gx] = count ? sum / count : 0;
+			}
+		}
+
+		bool changed = lores_signature_.size() != signature.size() ||
+					   timestamp_ns - last_lores_encode_ns_ >= (int64_t)options->preview_refresh_interval * 1000000;
+		bool motion = false;
+		if (completed_request->post_process_metadata.Get("motion_detect.result", motion) == 0 && motion)
+			changed = true;
+		for (unsigned int i = 0; !changed && i < signature.size(); i++)
+			changed = std::abs(signature[i] - lores_signature_[i]) > (int)options->preview_skip_threshold;
+
+		if (changed)
+		{
+			lores_signature_ = std::move(signature);
+			last_lores_encode_ns_ = timestamp_ns;
+		}
+		return changed;
+	}
+	std::vector<uint16_t> lores_signature_;
+	int64_t last_lores_encode_ns_ = 0;
+
+	// With --preview-idle-timeout, preview frames are only encoded while there's demand for them: a
+	// "pv" command, a process opening or reading one of the preview files (which inotify tells us
+	// about), or a client of the HTTP stream or Unix socket. Whatever else uses the lores stream, such
+	// as motion detection, carries on regardless.
+	bool previewWanted()
+	{
+		MJPEGOptions const *options = GetOptions();
+		if (!options->preview_idle_timeout || recording_from_preview_)
+			return true;
+		if (previewFilesOpened() || (preview_clients_callback_ && preview_clients_callback_()))
+			PreviewDemand();
+
+		bool wanted = std::chrono::steady_clock::now() - last_preview_demand_ <
+					  std::chrono::milliseconds(options->preview_idle_timeout);
+		if (wanted != preview_wanted_)
+			LOG(1, (wanted ? "Preview wanted, encoding resumed" : "Preview not wanted, encoding suspended"));
+		preview_wanted_ = wanted;
+		return wanted;
+	}
+
+	bool previewFilesOpened()
+	{
+		if (preview_watch_fd_ < 0)
+			return false;
+		alignas(struct inotify_event) char buffer[4096];
+		bool opened = false;
+		ssize_t n;
+		while ((n = read(preview_watch_fd_, buffer, sizeof(buffer))) > 0)
+		{
+			for (char const *p = buffer; p < buffer + n;)
+			{
+				struct inotify_event const *event = (struct inotify_event const *)p;
+				// If events were lost we can't tell, so assume someone was looking.
+				if (event->mask & IN_Q_OVERFLOW)
+					opened = true;
+				for (auto const &[wd, name] : preview_watches_)
+					opened = opened || (event->len && wd == event->wd && name == event->name);
+				p += sizeof(struct inotify_event) + event->len;
+			}
+		}
+		return opened;
+	}
+
+	void startPreviewWatch()
+	{
+		// Start out encoding, so that the preview files are there to be opened.
+		last_preview_demand_ = std::chrono::steady_clock::now();
+		preview_wanted_ = true;
+		if (!GetOptions()->preview_idle_timeout)
+			return;
+
+		preview_watch_fd_ = inotify_init1(IN_NONBLOCK | IN_CLOEXEC);
+		if (preview_watch_fd_ < 0)
+		{
+			LOG_ERROR("WARNING: unable to watch the preview files, only \"pv\" and clients will wake the preview");
+			return;
+		}
+		std::vector<std::string> outputs = { GetLoresOptions()->output };
+		for (auto const &size_options : preview_size_options_)
+			outputs.push_back(size_options->output);
+		for (std::string output : outputs)
+		{
+			// Readers open the published file, which doesn't have the ".tmp".
+			if (output.size() > 4 && output.substr(output.size() - 4) == ".tmp")
+				output.resize(output.size() - 4);
+			std::filesystem::path path(output);
+			std::string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+			int wd = inotify_add_watch(preview_watch_fd_, dir.c_str(), IN_OPEN | IN_ACCESS);
+			if (wd < 0)
+				LOG_ERROR("WARNING: unable to watch " << dir << " for readers of " << path.filename());
+			else
+				preview_watches_.emplace_back(wd, path.filename().string());
+		}
+	}
+
+	void stopPreviewWatch()
+	{
+		if (preview_watch_fd_ >= 0)
+			close(preview_watch_fd_);
+		preview_watch_fd_ = -1;
+		preview_watches_.clear();
+	}
+
+	std::chrono::steady_clock::time_point last_preview_demand_;
+	bool preview_wanted_ = true;
+	std::function<bool()> preview_clients_callback_;
+	int preview_watch_fd_ = -1;
+	// The directory watch and file name of each preview file.
+	std::vector<std::pair<int, std::string>> preview_watches_;
+
+	template <typename T>
+	void setControl(libcamera::Control<T> const &control, T value)
+	{
+		libcamera::ControlList controls;
+		controls.set(control, value);
+		SetControls(controls);
+	}
+
+	struct ConfigWrite
+	{
+		std::filesystem::path config_path;
+		std::string command;
+		std::string args;
+	};
+
+	void configThread()
+	{
+		std::unique_lock<std::mutex> lock(config_mutex_);
+		while (true)
+		{
+			config_cond_.wait(lock, [this] { return config_abort_ || !config_queue_.empty(); });
+			if (config_queue_.empty())
+				return;
+			ConfigWrite write = std::move(config_queue_.front());
+			config_queue_.pop_front();
+			lock.unlock();
+			writeOptionToConfigFile(write.config_path, write.command, write.args);
+			lock.lock();
+		}
+	}
+
+	void writeOptionToConfigFile(std::filesystem::path config_path, std::string command, std::string args)
+	{
+		if (!CreateConfigFile(config_path))
+		{
+			LOG(2, "Failed to create " << config_path);
+			return;
+		}
+		// Check for flags
+		std::ifstream mjpeg_config_file(config_path);
+    
+		if (!mjpeg_config_file.is_open()) {
+			std::cerr << "Error opening file: " << config_path << std::endl;
+			return;
+		}
+		std::string line;
+		std::stringstream fileContent;
+		bool commandFound = false;
+
+		// check if the command is already in the file
+		while (std::getline(mjpeg_config_file, line)) {
+
+			if (line.rfind(command, 0) == 0) { 
+				line = command + "=" + args;
+				commandFound = true;
+			}
+			fileContent << line << "\n";
+		}
+		mjpeg_config_file.close();
+
+
+		// Split into two cases: command found and command not found
+
+		// COMMAND NOT FOUND
+		if (!commandFound) {
+			std::ofstream mjpeg_config_file_out(config_path, std::ios::app);
+			if (!mjpeg_config_file_out.is_open()) {
+				std::cerr << "Error opening file: " << config_path << std::endl;
+				return;
+			}
+			// std::cout << "fileContent: " << fileContent.str() << std::endl;
+			std::cout << "Command not found in the file." << std::endl;
+			// Append the line.
+			mjpeg_config_file_out << command << "=" << args << "\n";
+			mjpeg_config_file_out.close();
+
+			// std::this_thread::sleep_for(std::chrono::seconds(10)); // Sleep for 1 second
+		}
+		// COMMAND FOUND
+		else {
+			LOG(2, "Command found in file:  " << command << "=" << args);
+			// std::cout << fileContent.str() << std::endl;
+			// Edit the line.
+			std::ifstream mjpeg_config_file_in(config_path);
+			while (std::getline(mjpeg_config_file_in, line)) {
+				// Check if the line starts with the option
+				if (line.find(command) == 0) {
+					// Replace the line with the new value
+					line = command + "=" + args;
+					LOG(2, "line: " << line);
+					commandFound = true;
+				}
+			mjpeg_config_file_in.close();
+			std::ofstream mjpeg_config_file_out(config_path, std::ios::trunc);
+			if (!mjpeg_config_file_out.is_open()) {
+				std::cerr << "Error opening file: " << config_path << std::endl;
+				return;
+			}
+			mjpeg_config_file_out << fileContent.str();
+			// mjpeg_config_file_out << line << std::endl;  // Write the line (modified or not) to the output file
+			mjpeg_config_file_out.close();
+			}
+			// std::this_thread::sleep_for(std::chrono::seconds(10)); // Sleep for 1 second
+		}
+	}
+
+
+	std::mutex config_mutex_;
+	std::condition_variable config_cond_;
+	std::deque<ConfigWrite> config_queue_;
+	bool config_abort_ = false;
+	std::thread config_thread_;
+
+	using EncodeBufferQueue = std::deque<std::pair<void *, CompletedRequestPtr>>;
+
+	// Find the request that the encoder has finished with. A null mem means the encoder returns
+	// buffers in order, otherwise it tells us which one (the MJPEG encoder can drop frames).
+	CompletedRequestPtr takeEncodeBuffer(EncodeBufferQueue &queue, void *mem)
+	{
+		if (queue.empty())
+			throw std::runtime_error("no buffer available to return");
+		auto it = queue.begin();
+		if (mem)
+		{
+			it = std::find_if(queue.begin(), queue.end(), [mem](auto const &item) { return item.first == mem; });
+			if (it == queue.end())
+				throw std::runtime_error("returned buffer not found");
+		}
+		CompletedRequestPtr completed_request = std::move(it->second);
+		queue.erase(it);
+		return completed_request;
+	}
+	void videoEncodeBufferDone(void *mem)
+	{
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+		CompletedRequestPtr completed_request = takeEncodeBuffer(video_buffer_queue_, mem);
+		if (video_metadata_ready_callback_ && !GetOptions()->metadata.empty())
+			video_metadata_ready_callback_(completed_request->metadata);
+	}
+	void loresEncodeBufferDone(void *mem)
+	{
+		std::lock_guard<std::mutex> lock(encode_buffer_queue_mutex_);
+		CompletedRequestPtr completed_request = takeEncodeBuffer(lores_buffer_queue_, mem);
+		if (lores_metadata_ready_callback_ && !GetOptions()->metadata.empty())
+			lores_metadata_ready_callback_(completed_request->metadata);
 	}
 
-	std::queue<CompletedRequestPtr> encode_buffer_queue_;
+	// Requests held until their encoder is done with them, separately for each stream.
+	EncodeBufferQueue video_buffer_queue_;
+	EncodeBufferQueue lores_buffer_queue_;
 	std::mutex encode_buffer_queue_mutex_;
 	EncodeOutputReadyCallback video_encode_output_ready_callback_;
 	EncodeOutputReadyCallback lores_encode_output_ready_callback_;
+	std::vector<EncodeOutputReadyCallback> lores_size_output_ready_callbacks_;
 	MetadataReadyCallback video_metadata_ready_callback_;
 	MetadataReadyCallback lores_metadata_ready_callback_;
 
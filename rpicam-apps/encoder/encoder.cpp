@@ -69,5 +69,7 @@ Encoder *Encoder::Create(MJPEGOptions *options, const StreamInfo &info)
 	// For all intents and purposes, MJPEGOptions is a subclass of VideoOptions.
 	// This is not reflected in inheritance, but in the fact that MJPEGOptions
 	// contains all the fields of VideoOptions, plus some additional fields.
+	if (strcasecmp(options->codec.c_str(), "mjpeg") == 0)
+		return new MjpegEncoder(options);
 	return Create((VideoOptions*) options, info);
 }
\ No newline at end of file
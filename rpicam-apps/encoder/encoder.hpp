@@ -22,8 +22,10 @@ public:
 	static Encoder *Create(VideoOptions *options, StreamInfo const &info);
 	static Encoder *Create(MJPEGOptions *options, StreamInfo const &info);
 
-	Encoder(VideoOptions const *options) : options_(options) {}
-	Encoder(MJPEGOptions const *options) : mjpeg_options_(options) {}
+	Encoder(VideoOptions const *options) : options_(options), mjpeg_options_(nullptr) {}
+	// MJPEGOptions carries all the VideoOptions fields in the same layout (see Encoder::Create),
+	// so encoders can keep using options_ and look at mjpeg_options_ for the extra settings.
+	Encoder(MJPEGOptions const *options) : options_((VideoOptions const *)options), mjpeg_options_(options) {}
 	
 	virtual ~Encoder() {}
 	// This is where the application sets the callback it gets whenever the encoder
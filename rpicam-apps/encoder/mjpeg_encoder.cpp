@@ -5,80 +5,756 @@
  * mjpeg_encoder.cpp - mjpeg video encoder.
  */
 
+#include <algorithm>
+#include <array>
 #include <chrono>
+#include <cmath>
+#include <cerrno>
+#include <cstring>
 #include <iostream>
+#include <sstream>
+
+#include <pthread.h>
+#include <sched.h>
+#include <sys/resource.h>
+#include <sys/syscall.h>
+#include <unistd.h>
 
 #include <jpeglib.h>
+#if TURBOJPEG_PRESENT
+#include <turbojpeg.h>
+#endif
 
 #include "mjpeg_encoder.hpp"
 
-#if JPEG_LIB_VERSION_MAJOR > 9 || (JPEG_LIB_VERSION_MAJOR == 9 && JPEG_LIB_VERSION_MINOR >= 4)
-typedef size_t jpeg_mem_len_t;
-#else
-typedef unsigned long jpeg_mem_len_t;
-#endif
+// A libjpeg destination manager that writes straight into one of our pooled buffers. The
+// buffer only has to grow if a frame is larger than anything recently seen.
+struct BufferDestination
+{
+	struct jpeg_destination_mgr pub;
+	std::vector<uint8_t> *buffer;
+};
+
+static void buffer_init_destination(j_compress_ptr cinfo)
+{
+	BufferDestination *dest = (BufferDestination *)cinfo->dest;
+	dest->pub.next_output_byte = dest->buffer->data();
+	dest->pub.free_in_buffer = dest->buffer->size();
+}
+
+static boolean buffer_empty_output_buffer(j_compress_ptr cinfo)
+{
+	BufferDestination *dest = (BufferDestination *)cinfo->dest;
+	size_t used = dest->buffer->size();
+	dest->buffer->resize(used * 2);
+	dest->pub.next_output_byte = dest->buffer->data() + used;
+	dest->pub.free_in_buffer = dest->buffer->size() - used;
+	return TRUE;
+}
+
+static void buffer_term_destination(j_compress_ptr cinfo)
+{
+}
+
+// Build a Huffman table, limited to 16 bit codes, from symbol frequencies. This is the procedure
+// from section K.2 of the JPEG standard, which libjpeg also uses for optimize_coding. An extra
+// symbol 256 is given a code and then taken out again so that no code is all ones.
+static void generate_huffman_table(std::array<long, 257> freq, uint8_t bits_out[17], uint8_t huffval[256])
+{
+	int codesize[257] = {};
+	int others[257];
+	std::fill(std::begin(others), std::end(others), -1);
+	freq[256] = 1;
+
+	while (true)
+	{
+		// Merge the two least frequent trees, preferring later symbols on ties.
+		int c1 = -1, c2 = -1;
+		for (int i = 0; i <= 256; i++)
+		{
+			if (freq[i] && (c1 < 0 || freq[i] <= freq[c1]))
+				c1 = i;
+		}
+		for (int i = 0; i <= 256; i++)
+		{
+			if (freq[i] && i != c1 && (c2 < 0 || freq[i] <= freq[c2]))
+				c2 = i;
+		}
+		if (c2 < 0)
+			break;
+
+		freq[c1] += freq[c2];
+		freq[c2] = 0;
+		for (codesize[c1]++; others[c1] >= 0; codesize[c1]++)
+			c1 = others[c1];
+		others[c1] = c2;
+		for (codesize[c2]++; others[c2] >= 0; codesize[c2]++)
+			c2 = others[c2];
+	}
+
+	int bits[33] = {};
+	for (int i = 0; i <= 256; i++)
+	{
+		if (codesize[i] > 32)
+			throw std::runtime_error("MjpegEncoder: Huffman code length overflow");
+		if (codesize[i])
+			bits[codesize[i]]++;
+	}
+	// Move any codes longer than 16 bits up the tree (section K.3), then remove the reserved one.
+	int i = 32;
+	for (; i > 16; i--)
+	{
+		while (bits[i] > 0)
+		{
+			int j = i - 2;
+			while (bits[j] == 0)
+				j--;
+			bits[i] -= 2;
+			bits[i - 1]++;
+			bits[j + 1] += 2;
+			bits[j]--;
+		}
+	}
+	while (bits[i] == 0)
+		i--;
+	bits[i]--;
+
+	std::copy(bits, bits + 17, bits_out);
+	int p = 0;
+	for (int len = 1; len <= 32; len++)
+	{
+		for (int j = 0; j < 256; j++)
+		{
+			if (codesize[j] == len)
+				huffval[p++] = j;
+		}
+	}
+}
+
+// Turn a table optimised for one frame into one that can code any frame. The code lengths the
+// optimised table gives its symbols stand in for their frequencies, and every symbol it lacks is
+// added as rarer than any of them.
+static void robust_huffman_table(JHUFF_TBL const *optimal, bool ac, uint8_t bits[17], uint8_t huffval[256])
+{
+	std::array<long, 257> freq = {};
+	if (ac)
+	{
+		freq[0x00] = freq[0xf0] = 1;
+		for (int run = 0; run < 16; run++)
+		{
+			for (int size = 1; size <= 10; size++)
+				freq[(run << 4) | size] = 1;
+		}
+	}
+	else
+	{
+		for (int size = 0; size <= 11; size++)
+			freq[size] = 1;
+	}
+	for (int len = 1, k = 0; len <= 16; len++)
+	{
+		for (int n = 0; n < optimal->bits[len]; n++, k++)
+			freq[optimal->huffval[k]] = 1L << (17 - len);
+	}
+	generate_huffman_table(freq, bits, huffval);
+}
+
+// Find the SOS segment (which the entropy-coded data follows) and the position of the frame
+// height in the SOF segment of a JPEG we have just written ourselves.
+static void find_jpeg_segments(uint8_t const *jpeg, size_t len, size_t &sos_start, size_t &sos_end,
+							   size_t &sof_height)
+{
+	sos_start = sos_end = sof_height = 0;
+	for (size_t pos = 2; pos + 4 <= len && jpeg[pos] == 0xff;)
+	{
+		uint8_t marker = jpeg[pos + 1];
+		size_t seg_len = (jpeg[pos + 2] << 8) | jpeg[pos + 3];
+		if (marker == 0xc0 || marker == 0xc1)
+			sof_height = pos + 5;
+		else if (marker == 0xda)
+		{
+			sos_start = pos;
+			sos_end = pos + 2 + seg_len;
+			break;
+		}
+		pos += 2 + seg_len;
+	}
+	if (!sos_end || !sof_height)
+		throw std::runtime_error("MjpegEncoder: could not parse strip headers");
+}
+
+// Box filter one image plane down to the given size. Each output row first sums its source rows
+// into acc, a simple loop over whole rows that the compiler vectorises, and only then are the
+// columns for each output pixel added up. A 16 bit accumulator is enough for up to 257 rows.
+static void box_downscale(uint8_t const *src, unsigned int src_width, unsigned int src_height,
+						  unsigned int src_stride, uint8_t *dst, unsigned int dst_width, unsigned int dst_height,
+						  unsigned int dst_stride, std::vector<uint16_t> &acc)
+{
+	acc.resize(src_width);
+	for (unsigned int y = 0; y < dst_height; y++)
+	{
+		unsigned int y0 = y * src_height / dst_height;
+		unsigned int y1 = std::max(y0 + 1, (y + 1) * src_height / dst_height);
+		std::fill(acc.begin(), acc.end(), 0);
+		for (unsigned int sy = y0; sy < y1; sy++)
+		{
+			uint8_t const *__restrict__ row = src + sy * src_stride;
+			uint16_t *__restrict__ a = acc.data();
+			for (unsigned int x = 0; x < src_width; x++)
+				a[x] += row[x];
+		}
+
+		uint8_t *out = dst + y * dst_stride;
+		for (unsigned int x = 0; x < dst_width; x++)
+		{
+			unsigned int x0 = x * src_width / dst_width;
+			unsigned int x1 = std::max(x0 + 1, (x + 1) * src_width / dst_width);
+			unsigned int sum = 0;
+			for (unsigned int sx = x0; sx < x1; sx++)
+				sum += acc[sx];
+			unsigned int area = (x1 - x0) * (y1 - y0);
+			out[x] = (sum + area / 2) / area;
+		}
+	}
+}
+
+// sem_wait, but carrying on if a signal interrupts it.
+static void semaphore_wait(sem_t *sem)
+{
+	while (sem_wait(sem) < 0 && errno == EINTR)
+		;
+}
+
+// Round buffer sizes up to whole pages, with some headroom over the recent frame sizes.
+static size_t output_buffer_size(size_t estimate)
+{
+	return ((estimate + estimate / 4) + 4095) & ~(size_t)4095;
+}
+
+// Parse a CPU list such as "0-2,5" into the CPU numbers it names.
+static std::vector<int> parse_cpu_list(std::string const &list)
+{
+	std::vector<int> cpus;
+	std::stringstream ss(list);
+	std::string range;
+	while (std::getline(ss, range, ','))
+	{
+		unsigned int first, last;
+		int n = sscanf(range.c_str(), "%u-%u", &first, &last);
+		if (n == 1)
+			last = first;
+		if (n < 1 || last < first || last >= CPU_SETSIZE)
+			throw std::runtime_error("invalid CPU list " + list);
+		for (unsigned int cpu = first; cpu <= last; cpu++)
+			cpus.push_back(cpu);
+	}
+	return cpus;
+}
+
+// Copy a frame out of the camera's buffer in blocks, prefetching each block while copying the one
+// before, so that the reads stream rather than stall on every cache line.
+static void staging_copy(uint8_t *dst, uint8_t const *src, size_t size)
+{
+	constexpr size_t BLOCK = 4096, LINE = 64;
+	for (size_t offset = 0; offset < size; offset += BLOCK)
+	{
+		size_t next_end = std::min(offset + 2 * BLOCK, size);
+		for (size_t p = offset + BLOCK; p < next_end; p += LINE)
+			__builtin_prefetch(src + p);
+		memcpy(dst + offset, src + offset, std::min(BLOCK, size - offset));
+	}
+}
+
+// Number of CPUs this process is allowed to run on.
+static unsigned int available_cpus()
+{
+	cpu_set_t mask;
+	if (sched_getaffinity(0, sizeof(mask), &mask) == 0)
+		return CPU_COUNT(&mask);
+	long n = sysconf(_SC_NPROCESSORS_ONLN);
+	return n > 0 ? n : 1;
+}
 
 MjpegEncoder::MjpegEncoder(VideoOptions const *options)
-	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0), encode_strips_(1), use_turbojpeg_(false),
+	  staging_(false), max_queue_depth_(0), drop_newest_(false), dropped_frames_(0), total_frames_(0),
+	  quality_(options->quality), target_frame_bytes_(0), target_byte_rate_(0), min_quality_(1), max_quality_(100),
+	  grayscale_mode_(GrayscaleOff), grayscale_threshold_(0), flat_chroma_frames_(0), huffman_interval_(0),
+	  encode_nice_(0), encode_sched_("normal"), buffer_size_estimate_(0)
 {
+	startThreads();
+}
+
+MjpegEncoder::MjpegEncoder(MJPEGOptions const *options)
+	: Encoder(options), abortEncode_(false), abortOutput_(false), index_(0), encode_strips_(1), use_turbojpeg_(false),
+	  staging_(false),
+	  max_queue_depth_(0), drop_newest_(false), dropped_frames_(0), total_frames_(0), quality_(options->quality),
+	  target_frame_bytes_(0), target_byte_rate_(0), min_quality_(1), max_quality_(100), grayscale_mode_(GrayscaleOff),
+	  grayscale_threshold_(0), flat_chroma_frames_(0), huffman_interval_(0), encode_nice_(0),
+	  encode_sched_("normal"), buffer_size_estimate_(0)
+{
+	startThreads();
+}
+
+void MjpegEncoder::startThreads()
+{
+	unsigned int threads = 0;
+	if (mjpeg_options_)
+	{
+		threads = mjpeg_options_->encode_threads;
+		encode_cpus_ = parse_cpu_list(mjpeg_options_->encode_cpus);
+		encode_nice_ = mjpeg_options_->encode_nice;
+		encode_sched_ = mjpeg_options_->encode_sched;
+		encode_strips_ = mjpeg_options_->encode_strips;
+		max_queue_depth_ = mjpeg_options_->encode_queue_depth;
+		drop_newest_ = mjpeg_options_->encode_drop_policy == "newest";
+		use_turbojpeg_ = mjpeg_options_->encode_backend == "turbojpeg";
+		staging_ = mjpeg_options_->encode_staging;
+		SetCrop(mjpeg_options_->encode_crop_x, mjpeg_options_->encode_crop_y, mjpeg_options_->encode_crop_width,
+				mjpeg_options_->encode_crop_height);
+		for (auto const &size : mjpeg_options_->encode_sizes)
+			sizes_.push_back({ size.width, size.height, size.quality, true, nullptr });
+		target_frame_bytes_ = mjpeg_options_->encode_target_frame_bytes;
+		target_byte_rate_ = mjpeg_options_->encode_target_byte_rate;
+		if (target_frame_bytes_ || target_byte_rate_)
+		{
+			min_quality_ = mjpeg_options_->encode_min_quality;
+			max_quality_ = mjpeg_options_->encode_max_quality;
+			quality_ = std::clamp(quality_.load(), min_quality_, max_quality_);
+		}
+		if (mjpeg_options_->encode_grayscale == "on")
+			grayscale_mode_ = GrayscaleOn;
+		else if (mjpeg_options_->encode_grayscale == "auto")
+			grayscale_mode_ = GrayscaleAuto;
+		grayscale_threshold_ = mjpeg_options_->encode_grayscale_threshold;
+		// TurboJPEG has no way to take our tables.
+		if (!use_turbojpeg_)
+			huffman_interval_ = mjpeg_options_->encode_huffman_interval;
+		if (huffman_interval_)
+		{
+			// Keep a copy of the standard tables for going back to.
+			struct jpeg_compress_struct cinfo;
+			struct jpeg_error_mgr jerr;
+			cinfo.err = jpeg_std_error(&jerr);
+			jpeg_create_compress(&cinfo);
+			cinfo.in_color_space = JCS_YCbCr;
+			jpeg_set_defaults(&cinfo);
+			auto tables = std::make_shared<HuffmanTables>();
+			for (unsigned int i = 0; i < 2; i++)
+			{
+				std::copy_n(cinfo.dc_huff_tbl_ptrs[i]->bits, 17, tables->dc[i].bits);
+				std::copy_n(cinfo.dc_huff_tbl_ptrs[i]->huffval, 256, tables->dc[i].huffval);
+				std::copy_n(cinfo.ac_huff_tbl_ptrs[i]->bits, 17, tables->ac[i].bits);
+				std::copy_n(cinfo.ac_huff_tbl_ptrs[i]->huffval, 256, tables->ac[i].huffval);
+			}
+			jpeg_destroy_compress(&cinfo);
+			standard_huffman_tables_ = tables;
+		}
+	}
+
+	if (!threads)
+	{
+		// Use all the CPUs we've been given. Otherwise leave one core free for the camera
+		// and application threads so that encoding can't hold up the request loop.
+		unsigned int cpus = encode_cpus_.empty() ? available_cpus() : encode_cpus_.size();
+		threads = encode_cpus_.empty() && cpus > 1 ? cpus - 1 : cpus;
+	}
+	num_enc_threads_ = threads;
+	if (!encode_strips_)
+		encode_strips_ = num_enc_threads_;
+
+	// At most OUTPUT_RING_SIZE frames are ever in flight, which bounds the encode queue too.
+	encode_queue_ = std::make_unique<MpmcQueue<EncodeItem>>(OUTPUT_RING_SIZE * (encode_strips_ + sizes_.size()));
+	output_ring_ = std::make_unique<OutputSlot[]>(OUTPUT_RING_SIZE);
+	for (unsigned int i = 0; i < OUTPUT_RING_SIZE; i++)
+		output_ring_[i].sequence.store(i, std::memory_order_relaxed);
+	sem_init(&encode_sem_, 0, 0);
+	sem_init(&output_sem_, 0, 0);
+	sem_init(&output_space_sem_, 0, OUTPUT_RING_SIZE);
+
 	output_thread_ = std::thread(&MjpegEncoder::outputThread, this);
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i] = std::thread(std::bind(&MjpegEncoder::encodeThread, this, i));
-	LOG(2, "Opened MjpegEncoder");
+	for (unsigned int i = 0; i < num_enc_threads_; i++)
+		encode_thread_.emplace_back(&MjpegEncoder::encodeThread, this, i);
+	LOG(2, "Opened MjpegEncoder with " << num_enc_threads_ << " encode threads"
+										<< (use_turbojpeg_ ? " using TurboJPEG" : "")
+										<< (staging_ ? ", staging input" : "")
+										<< (grayscale_mode_ == GrayscaleOn ? ", grayscale" : "")
+										<< (grayscale_mode_ == GrayscaleAuto ? ", automatic grayscale" : "")
+										<< (huffman_interval_ ? ", Huffman tables optimised every " +
+																	std::to_string(huffman_interval_) + " frames"
+															  : "")
+										<< (sizes_.size() ? ", " + std::to_string(sizes_.size()) + " extra sizes" : "")
+										<< (encode_strips_ > 1 ? ", " + std::to_string(encode_strips_) + " strips per frame" : "")
+										<< (target_frame_bytes_ ? ", targeting " + std::to_string(target_frame_bytes_) + " bytes per frame" : "")
+										<< (target_byte_rate_ ? ", targeting " + std::to_string(target_byte_rate_) + " bytes/s" : ""));
 }
 
 MjpegEncoder::~MjpegEncoder()
 {
+	// Each thread exits once it finds the queue empty after the abort flag is set, so wake them
+	// all one more time.
 	abortEncode_ = true;
-	for (int i = 0; i < NUM_ENC_THREADS; i++)
-		encode_thread_[i].join();
+	for (unsigned int i = 0; i < num_enc_threads_; i++)
+		sem_post(&encode_sem_);
+	for (auto &thread : encode_thread_)
+		thread.join();
 	abortOutput_ = true;
+	sem_post(&output_sem_);
 	output_thread_.join();
+	sem_destroy(&encode_sem_);
+	sem_destroy(&output_sem_);
+	sem_destroy(&output_space_sem_);
+	if (dropped_frames_)
+		LOG(1, "MjpegEncoder dropped " << dropped_frames_ << " of " << total_frames_ << " frames");
+	if ((target_frame_bytes_ || target_byte_rate_) && output_frames_ > 1 && last_timestamp_us_ > first_timestamp_us_)
+		LOG(1, "MjpegEncoder averaged " << output_bytes_ / output_frames_ << " bytes per frame, "
+										<< (uint64_t)(output_bytes_ * 1e6 / (last_timestamp_us_ - first_timestamp_us_))
+										<< " bytes/s, finishing at quality " << quality_);
+	if (hold_frames_)
+		LOG(2, "MjpegEncoder held input buffers for " << hold_time_total_ * 1000 / hold_frames_ << "ms on average");
 	LOG(2, "MjpegEncoder closed");
 }
 
 void MjpegEncoder::EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us)
 {
-	std::lock_guard<std::mutex> lock(encode_mutex_);
-	EncodeItem item = { mem, info, timestamp_us, index_++ };
-	encode_queue_.push(item);
-	encode_cond_var_.notify_all();
+	total_frames_++;
+	if (max_queue_depth_)
+	{
+		// Forget about frames the encode threads have picked up in the meantime.
+		pending_frames_.erase(std::remove_if(pending_frames_.begin(), pending_frames_.end(),
+											 [](auto const &frame) { return frame->state != Queued; }),
+							  pending_frames_.end());
+		if (pending_frames_.size() >= max_queue_depth_)
+		{
+			if (drop_newest_)
+			{
+				// The dropped frame's request goes back straight away so that it can't hold up the camera.
+				dropped_frames_++;
+				input_done_callback_(mem);
+				return;
+			}
+			dropOldestFrame();
+		}
+	}
+
+	// This only waits if OUTPUT_RING_SIZE frames are somehow still in flight, and the camera can't
+	// have handed us that many buffers.
+	semaphore_wait(&output_space_sem_);
+
+	std::shared_ptr<Frame> frame = std::make_shared<Frame>();
+	frame->mem = mem;
+	frame->queue_time = std::chrono::high_resolution_clock::now();
+	if (staging_)
+	{
+		size_t used = std::min<size_t>(size, info.stride * info.height * 3 / 2);
+		frame->staging = getStagingBuffer(used);
+		staging_copy(frame->staging.data(), (uint8_t const *)mem, used);
+		input_done_callback_(mem);
+		frame->mem = frame->staging.data();
+		hold_time_total_ += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+														   frame->queue_time).count();
+		hold_frames_++;
+	}
+	frame->info = info;
+	frame->planes = imagePlanes(frame->mem, info);
+	if (crop_width_ > 0 && crop_height_ > 0 && info.width >= 16 && info.height >= 16)
+	{
+		// Cropping to whole MCUs just means moving the plane pointers, so there's nothing to copy.
+		unsigned int x = std::min((unsigned int)(crop_x_ * info.width), info.width - 16) & ~15;
+		unsigned int y = std::min((unsigned int)(crop_y_ * info.height), info.height - 16) & ~15;
+		unsigned int width = std::max((unsigned int)(crop_width_ * info.width) & ~15, 16u);
+		unsigned int height = std::max((unsigned int)(crop_height_ * info.height) & ~15, 16u);
+		frame->info.width = std::min(width, info.width - x);
+		frame->info.height = std::min(height, info.height - y);
+		frame->planes.y += y * info.stride + x;
+		frame->planes.u += y / 2 * (info.stride / 2) + x / 2;
+		frame->planes.v += y / 2 * (info.stride / 2) + x / 2;
+	}
+	frame->timestamp_us = timestamp_us;
+	frame->index = index_++;
+	frame->quality = quality_.load(std::memory_order_relaxed);
+	frame->grayscale = grayscale_mode_ == GrayscaleOn;
+	if (grayscale_mode_ == GrayscaleAuto)
+	{
+		// Wait for about a second of flat chroma before switching, so as not to flicker in and out.
+		bool was_grayscale = flat_chroma_frames_ >= 30;
+		flat_chroma_frames_ = chromaIsFlat(frame->mem, info) ? flat_chroma_frames_ + 1 : 0;
+		frame->grayscale = flat_chroma_frames_ >= 30;
+		if (frame->grayscale != was_grayscale)
+			LOG(2, "MjpegEncoder: switching to " << (frame->grayscale ? "grayscale" : "colour"));
+	}
+	// An optimised frame can't be cut into strips, as they would all get different tables.
+	frame->optimize_huffman = huffman_interval_ && frame->index % huffman_interval_ == 0;
+	if (huffman_interval_)
+	{
+		std::lock_guard<std::mutex> lock(huffman_mutex_);
+		frame->huffman_tables = huffman_tables_;
+	}
+	frame->state = Queued;
+	frame->num_strips = 1;
+	frame->mcu_rows_per_strip = (frame->info.height + 15) / 16;
+
+	unsigned int mcu_rows = (frame->info.height + 15) / 16;
+	if (encode_strips_ > 1 && mcu_rows > 1 && !frame->optimize_huffman)
+	{
+		// Strips must be whole MCU rows, and a restart interval (one strip) is limited to 65535 MCUs.
+		// A grayscale MCU is a single 8x8 block, so there are four times as many.
+		unsigned int width = frame->info.width;
+		unsigned int mcus_per_row = frame->grayscale ? 2 * ((width + 7) / 8) : (width + 15) / 16;
+		unsigned int rows_per_strip = (mcu_rows + encode_strips_ - 1) / encode_strips_;
+		rows_per_strip = std::max(1u, std::min(rows_per_strip, 65535 / mcus_per_row));
+
+		frame->num_strips = (mcu_rows + rows_per_strip - 1) / rows_per_strip;
+		frame->mcu_rows_per_strip = rows_per_strip;
+	}
+	for (unsigned int i = 0; i < sizes_.size(); i++)
+	{
+		if (sizes_[i].enabled)
+			frame->sizes.push_back(i);
+	}
+	unsigned int num_parts = frame->num_strips + frame->sizes.size();
+	if (num_parts > 1)
+	{
+		frame->buffers.resize(num_parts);
+		frame->bytes_used.resize(num_parts);
+	}
+	frame->remaining = num_parts;
+
+	if (max_queue_depth_)
+		pending_frames_.push_back(frame);
+	for (unsigned int part = 0; part < num_parts; part++)
+	{
+		// There's room for the items of every frame that output_space_sem_ lets through.
+		if (!encode_queue_->TryPush({ frame, part }))
+			throw std::runtime_error("MjpegEncoder: encode queue overflow");
+		sem_post(&encode_sem_);
+	}
+}
+
+uint64_t MjpegEncoder::DroppedFrames()
+{
+	return dropped_frames_;
 }
 
-void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer,
-							  size_t &buffer_len)
+void MjpegEncoder::SetSizeOutputReadyCallback(unsigned int size, OutputReadyCallback callback)
 {
-	// Copied from YUV420_to_JPEG_fast in jpeg.cpp.
-	cinfo.image_width = item.info.width;
-	cinfo.image_height = item.info.height;
-	cinfo.input_components = 3;
-	cinfo.in_color_space = JCS_YCbCr;
+	sizes_.at(size).output_ready_callback = callback;
+}
+
+void MjpegEncoder::SetSizeEnabled(unsigned int size, bool enabled)
+{
+	sizes_.at(size).enabled = enabled;
+}
+
+void MjpegEncoder::SetCrop(float x, float y, float width, float height)
+{
+	crop_x_ = std::clamp(x, 0.0f, 1.0f);
+	crop_y_ = std::clamp(y, 0.0f, 1.0f);
+	crop_width_ = std::clamp(width, 0.0f, 1.0f);
+	crop_height_ = std::clamp(height, 0.0f, 1.0f);
+}
+
+MjpegEncoder::Planes MjpegEncoder::imagePlanes(void *mem, StreamInfo const &info)
+{
+	uint8_t *y = (uint8_t *)mem;
+	uint8_t *u = y + info.stride * info.height;
+	return { y, u, u + info.stride / 2 * (info.height / 2) };
+}
+
+bool MjpegEncoder::chromaIsFlat(void *mem, StreamInfo const &info) const
+{
+	// Sample every 8th chroma pixel in each direction, and add up the variance of both planes.
+	unsigned int stride2 = info.stride / 2, width2 = info.width / 2, height2 = info.height / 2;
+	uint8_t const *U = (uint8_t const *)mem + info.stride * info.height;
+	uint8_t const *V = U + stride2 * height2;
+	uint64_t sum_u = 0, sum_v = 0, sum_sq = 0, n = 0;
+	for (unsigned int y = 0; y < height2; y += 8)
+	{
+		for (unsigned int x = 0; x < width2; x += 8, n++)
+		{
+			unsigned int u = U[y * stride2 + x], v = V[y * stride2 + x];
+			sum_u += u;
+			sum_v += v;
+			sum_sq += u * u + v * v;
+		}
+	}
+	if (!n)
+		return false;
+	double variance = (double)sum_sq / n - ((double)sum_u * sum_u + (double)sum_v * sum_v) / ((double)n * n);
+	return variance <= grayscale_threshold_;
+}
+
+void MjpegEncoder::dropOldestFrame()
+{
+	// An encode thread may claim a frame at any moment, in which case we try the next one.
+	while (!pending_frames_.empty())
+	{
+		std::shared_ptr<Frame> frame = std::move(pending_frames_.front());
+		pending_frames_.pop_front();
+		int expected = Queued;
+		if (frame->state.compare_exchange_strong(expected, Dropped))
+		{
+			// Its items stay in the queue, but the encode threads will skip them. The output
+			// thread needs to be told to skip its index.
+			dropped_frames_++;
+			if (staging_)
+				returnStagingBuffer(std::move(frame->staging));
+			else
+				input_done_callback_(frame->mem);
+			publishOutput(frame->index, { nullptr, {}, 0, 0, 0, {}, {}, {} });
+			return;
+		}
+	}
+}
+
+std::vector<uint8_t> MjpegEncoder::getStagingBuffer(size_t size)
+{
+	std::vector<uint8_t> buffer;
+	{
+		std::lock_guard<std::mutex> lock(staging_pool_mutex_);
+		if (!staging_pool_.empty())
+		{
+			buffer = std::move(staging_pool_.back());
+			staging_pool_.pop_back();
+		}
+	}
+	buffer.resize(size);
+	return buffer;
+}
+
+void MjpegEncoder::returnStagingBuffer(std::vector<uint8_t> &&buffer)
+{
+	std::lock_guard<std::mutex> lock(staging_pool_mutex_);
+	staging_pool_.push_back(std::move(buffer));
+}
+
+void MjpegEncoder::publishOutput(uint64_t index, OutputItem &&item)
+{
+	OutputSlot &slot = output_ring_[index % OUTPUT_RING_SIZE];
+	slot.item = std::move(item);
+	slot.sequence.store(index + 1, std::memory_order_release);
+	sem_post(&output_sem_);
+}
+
+std::vector<uint8_t> MjpegEncoder::getOutputBuffer(StreamInfo const &info)
+{
+	std::vector<uint8_t> buffer;
+	size_t size;
+	{
+		std::lock_guard<std::mutex> lock(buffer_pool_mutex_);
+		if (!buffer_size_estimate_)
+			buffer_size_estimate_ = info.width * info.height / 2;
+		size = output_buffer_size(buffer_size_estimate_);
+		if (!buffer_pool_.empty())
+		{
+			buffer = std::move(buffer_pool_.back());
+			buffer_pool_.pop_back();
+		}
+	}
+
+	// Only frames bigger than recent ones cause any allocation here.
+	if (buffer.size() < size)
+		buffer.resize(size);
+	return buffer;
+}
+
+void MjpegEncoder::returnOutputBuffer(std::vector<uint8_t> &&buffer, size_t bytes_used)
+{
+	std::lock_guard<std::mutex> lock(buffer_pool_mutex_);
+	// Track the largest recent frame, decaying slowly so that one big frame doesn't
+	// inflate every buffer for ever.
+	buffer_size_estimate_ = std::max(bytes_used, buffer_size_estimate_ - buffer_size_estimate_ / 64);
+	buffer_pool_.push_back(std::move(buffer));
+}
+
+void MjpegEncoder::prepareCompressor(struct jpeg_compress_struct &cinfo, CompressorConfig &config, int quality,
+									 bool grayscale, std::shared_ptr<HuffmanTables const> const &huffman_tables)
+{
+	if (config.quality == quality && config.grayscale == grayscale && config.huffman_tables == huffman_tables)
+		return;
+
+	// Copied from YUV420_to_JPEG_fast in jpeg.cpp. The quantisation and Huffman tables this
+	// builds stay in the compressor, so we only pay for it when the configuration changes.
+	cinfo.input_components = grayscale ? 1 : 3;
+	cinfo.in_color_space = grayscale ? JCS_GRAYSCALE : JCS_YCbCr;
 	cinfo.restart_interval = 0;
 
 	jpeg_set_defaults(&cinfo);
 	cinfo.raw_data_in = TRUE;
-	jpeg_set_quality(&cinfo, options_->quality, TRUE);
-	encoded_buffer = nullptr;
-	buffer_len = 0;
-	jpeg_mem_len_t jpeg_mem_len;
-	jpeg_mem_dest(&cinfo, &encoded_buffer, &jpeg_mem_len);
+	jpeg_set_quality(&cinfo, quality, TRUE);
+
+	// Install the Huffman tables. This has to happen even without any of our own, because
+	// jpeg_set_defaults won't undo an optimised encode.
+	if (huffman_interval_)
+	{
+		HuffmanTables const &tables = huffman_tables ? *huffman_tables : *standard_huffman_tables_;
+		for (unsigned int i = 0; i < 2; i++)
+		{
+			std::copy_n(tables.dc[i].bits, 17, cinfo.dc_huff_tbl_ptrs[i]->bits);
+			std::copy_n(tables.dc[i].huffval, 256, cinfo.dc_huff_tbl_ptrs[i]->huffval);
+			std::copy_n(tables.ac[i].bits, 17, cinfo.ac_huff_tbl_ptrs[i]->bits);
+			std::copy_n(tables.ac[i].huffval, 256, cinfo.ac_huff_tbl_ptrs[i]->huffval);
+		}
+	}
+
+	config.quality = quality;
+	config.grayscale = grayscale;
+	config.huffman_tables = huffman_tables;
+	LOG(2, "MjpegEncoder: compressor prepared for quality " << quality << (grayscale ? ", grayscale" : ""));
+}
+
+void MjpegEncoder::stripRows(Frame const &frame, unsigned int strip, unsigned int &first_row, unsigned int &height)
+{
+	// A strip is encoded as a JPEG of its own, covering just its rows. That way its entropy-coded
+	// data can be dropped straight into the full frame.
+	unsigned int strip_rows = frame.mcu_rows_per_strip * 16;
+	first_row = strip * strip_rows;
+	height = std::min(strip_rows, frame.info.height - first_row);
+}
+
+void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, CompressorConfig &config, Frame const &frame,
+							  int quality, bool optimize, Planes const &planes, StreamInfo const &info,
+							  unsigned int first_row, unsigned int height, std::vector<uint8_t> &buffer,
+							  size_t &bytes_used)
+{
+	bool grayscale = frame.grayscale;
+	prepareCompressor(cinfo, config, quality, grayscale, frame.huffman_tables);
+	cinfo.optimize_coding = optimize;
+	cinfo.image_width = info.width;
+	cinfo.image_height = height;
+
+	BufferDestination *dest = (BufferDestination *)cinfo.dest;
+	dest->buffer = &buffer;
 	jpeg_start_compress(&cinfo, TRUE);
 
-	int stride2 = item.info.stride / 2;
-	uint8_t *Y = (uint8_t *)item.mem;
-	uint8_t *U = (uint8_t *)Y + item.info.stride * item.info.height;
-	uint8_t *V = (uint8_t *)U + stride2 * (item.info.height / 2);
-	uint8_t *Y_max = U - item.info.stride;
-	uint8_t *U_max = V - stride2;
-	uint8_t *V_max = U_max + stride2 * (item.info.height / 2);
+	// The planes may be a window onto a larger image, so rows past the bottom of ours repeat its last row.
+	int stride2 = info.stride / 2;
+	uint8_t *Y = planes.y;
+	uint8_t *U = planes.u;
+	uint8_t *V = planes.v;
+	uint8_t *Y_max = Y + info.stride * (info.height - 1);
+	uint8_t *U_max = U + stride2 * (info.height / 2 - 1);
+	uint8_t *V_max = V + stride2 * (info.height / 2 - 1);
 
 	JSAMPROW y_rows[16];
 	JSAMPROW u_rows[8];
 	JSAMPROW v_rows[8];
 
-	for (uint8_t *Y_row = Y, *U_row = U, *V_row = V; cinfo.next_scanline < item.info.height;)
+	// A grayscale image is just the Y plane, which the compressor takes 8 rows at a time.
+	for (uint8_t *Y_row = Y + first_row * info.stride; grayscale && cinfo.next_scanline < height;)
 	{
-		for (int i = 0; i < 16; i++, Y_row += item.info.stride)
+		for (int i = 0; i < 8; i++, Y_row += info.stride)
+			y_rows[i] = std::min(Y_row, Y_max);
+
+		JSAMPARRAY rows[] = { y_rows };
+		jpeg_write_raw_data(&cinfo, rows, 8);
+	}
+
+	for (uint8_t *Y_row = Y + first_row * info.stride, *U_row = U + (first_row / 2) * stride2,
+				 *V_row = V + (first_row / 2) * stride2;
+		 !grayscale && cinfo.next_scanline < height;)
+	{
+		for (int i = 0; i < 16; i++, Y_row += info.stride)
 			y_rows[i] = std::min(Y_row, Y_max);
 		for (int i = 0; i < 8; i++, U_row += stride2, V_row += stride2)
 			u_rows[i] = std::min(U_row, U_max), v_rows[i] = std::min(V_row, V_max);
@@ -88,106 +764,380 @@ void MjpegEncoder::encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &it
 	}
 
 	jpeg_finish_compress(&cinfo);
-	buffer_len = jpeg_mem_len;
+	bytes_used = buffer.size() - dest->pub.free_in_buffer;
+
+	// The compressor is left holding the optimised tables, so it needs setting up again anyway.
+	if (optimize)
+	{
+		updateHuffmanTables(cinfo, grayscale);
+		config = CompressorConfig();
+	}
+}
+
+void MjpegEncoder::updateHuffmanTables(struct jpeg_compress_struct &cinfo, bool grayscale)
+{
+	// A grayscale frame only has luma tables, so keep whatever chroma ones we had.
+	std::lock_guard<std::mutex> lock(huffman_mutex_);
+	auto tables = std::make_shared<HuffmanTables>(huffman_tables_ ? *huffman_tables_ : *standard_huffman_tables_);
+	for (unsigned int i = 0; i < (grayscale ? 1 : 2); i++)
+	{
+		robust_huffman_table(cinfo.dc_huff_tbl_ptrs[i], false, tables->dc[i].bits, tables->dc[i].huffval);
+		robust_huffman_table(cinfo.ac_huff_tbl_ptrs[i], true, tables->ac[i].bits, tables->ac[i].huffval);
+	}
+	huffman_tables_ = std::move(tables);
+	LOG(3, "MjpegEncoder: Huffman tables updated");
+}
+
+#if TURBOJPEG_PRESENT
+void MjpegEncoder::encodeTurboJPEG(void *handle, int quality, bool grayscale, Planes const &planes,
+								   StreamInfo const &info, unsigned int first_row, unsigned int height,
+								   std::vector<uint8_t> &buffer, size_t &bytes_used)
+{
+	int stride2 = info.stride / 2;
+	unsigned char const *rows[] = { planes.y + first_row * info.stride, planes.u + (first_row / 2) * stride2,
+									planes.v + (first_row / 2) * stride2 };
+	int strides[] = { (int)info.stride, stride2, stride2 };
+
+	// TurboJPEG writes into our buffer as long as it's big enough for the worst case, so once the
+	// pooled buffers have grown to that size it never allocates.
+	int subsamp = grayscale ? TJSAMP_GRAY : TJSAMP_420;
+	unsigned long size = tjBufSize(info.width, height, subsamp);
+	if (buffer.size() < size)
+		buffer.resize(size);
+	unsigned char *jpeg = buffer.data();
+	unsigned long jpeg_size = buffer.size();
+	if (tjCompressFromYUVPlanes(handle, rows, info.width, strides, height, subsamp, &jpeg, &jpeg_size,
+								quality, TJFLAG_NOREALLOC) < 0)
+		throw std::runtime_error(std::string("MjpegEncoder: TurboJPEG encode failed: ") + tjGetErrorStr2(handle));
+	bytes_used = jpeg_size;
+}
+#endif
+
+void MjpegEncoder::joinStrips(Frame &frame, std::vector<uint8_t> &buffer, size_t &bytes_used)
+{
+	// The headers of the first strip serve for the whole frame once the height is patched and a
+	// DRI segment, making each strip one restart interval, is added. After that it's the
+	// entropy-coded data of each strip, separated by restart markers. No encoder needs to know
+	// about restart intervals for this, because a whole image encoded on its own is coded exactly
+	// as a single restart interval would be.
+	std::vector<uint8_t> const &first = frame.buffers[0];
+	size_t sos_start, sos_end, sof_height;
+	find_jpeg_segments(first.data(), frame.bytes_used[0], sos_start, sos_end, sof_height);
+
+	size_t total = sos_end + 6;
+	for (unsigned int i = 0; i < frame.num_strips; i++)
+		total += frame.bytes_used[i] + 2;
+	if (buffer.size() < total)
+		buffer.resize(total);
+
+	unsigned int restart_interval = frame.grayscale ? frame.mcu_rows_per_strip * 2 * ((frame.info.width + 7) / 8)
+													: frame.mcu_rows_per_strip * ((frame.info.width + 15) / 16);
+	uint8_t *dest = buffer.data();
+	memcpy(dest, first.data(), sos_start);
+	dest[sof_height] = frame.info.height >> 8;
+	dest[sof_height + 1] = frame.info.height & 0xff;
+	dest += sos_start;
+	uint8_t dri[] = { 0xff, 0xdd, 0x00, 0x04, (uint8_t)(restart_interval >> 8), (uint8_t)(restart_interval & 0xff) };
+	memcpy(dest, dri, sizeof(dri));
+	dest += sizeof(dri);
+	memcpy(dest, first.data() + sos_start, sos_end - sos_start);
+	dest += sos_end - sos_start;
+
+	for (unsigned int i = 0; i < frame.num_strips; i++)
+	{
+		std::vector<uint8_t> const &strip = frame.buffers[i];
+		size_t strip_sos_start, strip_sos_end = sos_end, strip_sof_height;
+		if (i)
+			find_jpeg_segments(strip.data(), frame.bytes_used[i], strip_sos_start, strip_sos_end, strip_sof_height);
+		// Each strip ends with an EOI marker, which we leave out.
+		size_t data_len = frame.bytes_used[i] - 2 - strip_sos_end;
+		memcpy(dest, strip.data() + strip_sos_end, data_len);
+		dest += data_len;
+		*dest++ = 0xff;
+		*dest++ = i + 1 < frame.num_strips ? 0xd0 + (i & 7) : 0xd9;
+	}
+	bytes_used = dest - buffer.data();
+}
+
+void MjpegEncoder::setEncodeThreadPriority()
+{
+	if (!encode_cpus_.empty())
+	{
+		cpu_set_t mask;
+		CPU_ZERO(&mask);
+		for (int cpu : encode_cpus_)
+			CPU_SET(cpu, &mask);
+		int ret = pthread_setaffinity_np(pthread_self(), sizeof(mask), &mask);
+		if (ret)
+			LOG_ERROR("WARNING: MjpegEncoder: failed to set CPU affinity: " << strerror(ret));
+	}
+
+	if (encode_sched_ != "normal")
+	{
+		sched_param param = {};
+		int policy = encode_sched_ == "idle" ? SCHED_IDLE : SCHED_BATCH;
+		int ret = pthread_setschedparam(pthread_self(), policy, &param);
+		if (ret)
+			LOG_ERROR("WARNING: MjpegEncoder: failed to set " << encode_sched_ << " scheduling: " << strerror(ret));
+	}
+
+	// Nice values are per-thread on Linux, so this only affects the calling thread.
+	if (encode_nice_ && setpriority(PRIO_PROCESS, syscall(SYS_gettid), encode_nice_) < 0)
+		LOG_ERROR("WARNING: MjpegEncoder: failed to set nice value " << encode_nice_ << ": " << strerror(errno));
 }
 
 void MjpegEncoder::encodeThread(int num)
 {
+	setEncodeThreadPriority();
+
 	struct jpeg_compress_struct cinfo;
 	struct jpeg_error_mgr jerr;
 	cinfo.err = jpeg_std_error(&jerr);
 	jpeg_create_compress(&cinfo);
+	BufferDestination dest;
+	dest.pub.init_destination = buffer_init_destination;
+	dest.pub.empty_output_buffer = buffer_empty_output_buffer;
+	dest.pub.term_destination = buffer_term_destination;
+	dest.buffer = nullptr;
+	cinfo.dest = &dest.pub;
+	CompressorConfig config;
+	// Scratch space for scaling down to the extra sizes.
+	std::vector<uint8_t> scaled;
+	std::vector<uint16_t> acc;
+#if TURBOJPEG_PRESENT
+	tjhandle tj_handle = nullptr;
+	if (use_turbojpeg_ && !(tj_handle = tjInitCompress()))
+		throw std::runtime_error("MjpegEncoder: failed to create TurboJPEG compressor");
+#endif
 	std::chrono::duration<double> encode_time(0);
 	uint32_t frames = 0;
 
 	EncodeItem encode_item;
 	while (true)
 	{
+		semaphore_wait(&encode_sem_);
+		if (!encode_queue_->TryPop(encode_item))
 		{
-			std::unique_lock<std::mutex> lock(encode_mutex_);
-			while (true)
-			{
-				using namespace std::chrono_literals;
-				if (abortEncode_ && encode_queue_.empty())
-				{
-					if (frames)
-						LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames
-										 << "ms");
-					jpeg_destroy_compress(&cinfo);
-					return;
-				}
-				if (!encode_queue_.empty())
-				{
-					encode_item = encode_queue_.front();
-					encode_queue_.pop();
-					break;
-				}
-				else
-					encode_cond_var_.wait_for(lock, 200ms);
-			}
+			if (abortEncode_)
+				break;
+			continue;
+		}
+
+		// Claim the frame so it can no longer be dropped, unless that has already happened.
+		Frame &frame = *encode_item.frame;
+		int expected = Queued;
+		if (!frame.state.compare_exchange_strong(expected, Claimed) && expected == Dropped)
+		{
+			encode_item.frame.reset();
+			continue;
 		}
 
-		// Encode the buffer.
-		uint8_t *encoded_buffer = nullptr;
-		size_t buffer_len = 0;
+		// Encode the buffer, or the part of it this item is for.
+		std::vector<uint8_t> buffer = getOutputBuffer(frame.info);
+		size_t bytes_used = 0;
 		auto start_time = std::chrono::high_resolution_clock::now();
-		encodeJPEG(cinfo, encode_item, encoded_buffer, buffer_len);
+		Planes planes = frame.planes;
+		StreamInfo info = frame.info;
+		unsigned int first_row = 0, height = info.height;
+		int quality = frame.quality;
+		Size const *size = encode_item.part < frame.num_strips
+							   ? nullptr
+							   : &sizes_[frame.sizes[encode_item.part - frame.num_strips]];
+		if (size && size->quality)
+			quality = size->quality;
+		if (!size)
+			stripRows(frame, encode_item.part, first_row, height);
+		else if (size->width)
+		{
+			// One of the extra sizes, which we scale down into our own buffer first.
+			info.width = size->width;
+			info.height = height = size->height;
+			info.stride = (size->width + 31) & ~31;
+			scaled.resize(info.stride * info.height * 3 / 2);
+			planes = imagePlanes(scaled.data(), info);
+			box_downscale(frame.planes.y, frame.info.width, frame.info.height, frame.info.stride, planes.y,
+						  info.width, info.height, info.stride, acc);
+			if (!frame.grayscale)
+			{
+				box_downscale(frame.planes.u, frame.info.width / 2, frame.info.height / 2, frame.info.stride / 2,
+							  planes.u, info.width / 2, info.height / 2, info.stride / 2, acc);
+				box_downscale(frame.planes.v, frame.info.width / 2, frame.info.height / 2, frame.info.stride / 2,
+							  planes.v, info.width / 2, info.height / 2, info.stride / 2, acc);
+			}
+		}
+#if TURBOJPEG_PRESENT
+		if (use_turbojpeg_)
+			encodeTurboJPEG(tj_handle, quality, frame.grayscale, planes, info, first_row, height, buffer,
+							bytes_used);
+		else
+#endif
+			encodeJPEG(cinfo, config, frame, quality, frame.optimize_huffman && encode_item.part < frame.num_strips,
+					   planes, info, first_row, height, buffer, bytes_used);
 		encode_time += (std::chrono::high_resolution_clock::now() - start_time);
 		frames++;
+
+		OutputItem output_item = { frame.mem, {}, 0, frame.timestamp_us, frame.quality, frame.queue_time, {}, {} };
+		if (frame.buffers.empty())
+		{
+			output_item.buffer = std::move(buffer);
+			output_item.bytes_used = bytes_used;
+		}
+		else
+		{
+			// Only the thread finishing the last part of a frame carries on to output it.
+			frame.buffers[encode_item.part] = std::move(buffer);
+			frame.bytes_used[encode_item.part] = bytes_used;
+			if (frame.remaining.fetch_sub(1, std::memory_order_acq_rel) != 1)
+			{
+				encode_item.frame.reset();
+				continue;
+			}
+
+			if (frame.num_strips > 1)
+			{
+				output_item.buffer = getOutputBuffer(frame.info);
+				joinStrips(frame, output_item.buffer, output_item.bytes_used);
+				for (unsigned int i = 0; i < frame.num_strips; i++)
+					returnOutputBuffer(std::move(frame.buffers[i]), frame.bytes_used[i]);
+			}
+			else
+			{
+				output_item.buffer = std::move(frame.buffers[0]);
+				output_item.bytes_used = frame.bytes_used[0];
+			}
+			output_item.size_buffers.resize(sizes_.size());
+			output_item.size_bytes_used.resize(sizes_.size());
+			for (unsigned int i = 0; i < frame.sizes.size(); i++)
+			{
+				output_item.size_buffers[frame.sizes[i]] = std::move(frame.buffers[frame.num_strips + i]);
+				output_item.size_bytes_used[frame.sizes[i]] = frame.bytes_used[frame.num_strips + i];
+			}
+		}
+		// The input is finished with, though without staging the output thread returns it, in order.
+		if (staging_)
+			returnStagingBuffer(std::move(frame.staging));
 		// Don't return buffers until the output thread as that's where they're
 		// in order again.
 
 		// We push this encoded buffer to another thread so that our
 		// application can take its time with the data without blocking the
 		// encode process.
-		OutputItem output_item = { encoded_buffer, buffer_len, encode_item.timestamp_us, encode_item.index };
-		std::lock_guard<std::mutex> lock(output_mutex_);
-		output_queue_[num].push(output_item);
-		output_cond_var_.notify_one();
+		publishOutput(frame.index, std::move(output_item));
+		encode_item.frame.reset();
 	}
+
+	if (frames)
+		LOG(2, "Encode " << frames << " frames, average time " << encode_time.count() * 1000 / frames << "ms");
+	jpeg_destroy_compress(&cinfo);
+#if TURBOJPEG_PRESENT
+	if (tj_handle)
+		tjDestroy(tj_handle);
+#endif
 }
 
 void MjpegEncoder::outputThread()
 {
-	OutputItem item;
 	uint64_t index = 0;
 	while (true)
 	{
+		semaphore_wait(&output_sem_);
+		// Once the abort flag is seen every frame has been published, so draining the ring one
+		// last time gets them all.
+		bool abort = abortOutput_;
+
+		// Output everything that's ready in order. Each wakeup corresponds to a slot being filled,
+		// though not necessarily the one we want next.
+		while (true)
 		{
-			std::unique_lock<std::mutex> lock(output_mutex_);
-			while (true)
+			OutputSlot &slot = output_ring_[index % OUTPUT_RING_SIZE];
+			if (slot.sequence.load(std::memory_order_acquire) != index + 1)
+				break;
+			OutputItem item = std::move(slot.item);
+			slot.sequence.store(index + OUTPUT_RING_SIZE, std::memory_order_relaxed);
+
+			// A dropped frame has already had its input returned, and has nothing to output.
+			if (item.mem)
 			{
-				using namespace std::chrono_literals;
-				// We look for the thread that's completed the frame we want next.
-				// If we don't find it, we wait.
-				//
-				// Must also check for an abort signal, and if set, all queues must
-				// be empty. This is done first to ensure all frame callbacks have
-				// had a chance to run.
-				bool abort = abortOutput_ ? true : false;
-				for (auto &q : output_queue_)
+				if (!staging_)
 				{
-					if (abort && !q.empty())
-						abort = false;
-
-					if (!q.empty() && q.front().index == index)
-					{
-						item = q.front();
-						q.pop();
-						goto got_item;
-					}
+					input_done_callback_(item.mem);
+					hold_time_total_ += std::chrono::duration<double>(std::chrono::high_resolution_clock::now() -
+																	   item.queue_time).count();
+					hold_frames_++;
 				}
-				if (abort)
-					return;
-
-				output_cond_var_.wait_for(lock, 200ms);
+				output_ready_callback_(item.buffer.data(), item.bytes_used, item.timestamp_us, true);
+				updateRateControl(item.bytes_used, item.timestamp_us, item.quality);
+				for (unsigned int i = 0; i < item.size_buffers.size(); i++)
+				{
+					if (item.size_buffers[i].empty())
+						continue;
+					if (sizes_[i].output_ready_callback)
+						sizes_[i].output_ready_callback(item.size_buffers[i].data(), item.size_bytes_used[i],
+														item.timestamp_us, true);
+					returnOutputBuffer(std::move(item.size_buffers[i]), item.size_bytes_used[i]);
+				}
+				returnOutputBuffer(std::move(item.buffer), item.bytes_used);
 			}
+			index++;
+			sem_post(&output_space_sem_);
 		}
-	got_item:
-		input_done_callback_(nullptr);
 
-		output_ready_callback_(item.mem, item.bytes_used, item.timestamp_us, true);
-		free(item.mem);
-		index++;
+		if (abort)
+			return;
+	}
+}
+
+void MjpegEncoder::updateRateControl(size_t bytes_used, int64_t timestamp_us, int quality)
+{
+	if (!output_frames_)
+		first_timestamp_us_ = report_timestamp_us_ = timestamp_us;
+	else
+	{
+		double interval = timestamp_us - last_timestamp_us_;
+		frame_interval_average_ =
+			frame_interval_average_ ? frame_interval_average_ + (interval - frame_interval_average_) / 16 : interval;
+	}
+	last_timestamp_us_ = timestamp_us;
+	output_bytes_ += bytes_used;
+	output_frames_++;
+	report_bytes_ += bytes_used;
+	report_frames_++;
+	if (timestamp_us - report_timestamp_us_ >= 5000000)
+	{
+		LOG(2, "MjpegEncoder: " << report_bytes_ / report_frames_ << " bytes per frame, "
+								<< (uint64_t)(report_bytes_ * 1e6 / (timestamp_us - report_timestamp_us_))
+								<< " bytes/s at quality " << quality_);
+		report_bytes_ = report_frames_ = 0;
+		report_timestamp_us_ = timestamp_us;
+	}
+
+	// A rate target becomes a size target once we know the frame rate (which skipped and dropped
+	// frames make lower than the camera's).
+	double target = target_frame_bytes_ ? target_frame_bytes_ : target_byte_rate_ * frame_interval_average_ / 1e6;
+	int current = quality_.load(std::memory_order_relaxed);
+	// Frames queued before the last change say nothing about the current quality.
+	if (!target || quality != current)
+		return;
+
+	frame_bytes_average_ = frame_bytes_samples_ ? frame_bytes_average_ + (bytes_used - frame_bytes_average_) / 4
+												: bytes_used;
+	if (++frame_bytes_samples_ < 2)
+		return;
+
+	// Frame size goes up roughly exponentially with quality over the useful range, so step by the
+	// log of the error. Go down sooner and faster than up, as overshooting the target is what hurts.
+	double error = std::log2(target / std::max(frame_bytes_average_, 1.0));
+	int step = 0;
+	if (error < -0.03)
+		step = -std::clamp((int)std::ceil(-error * 8), 1, 8);
+	else if (error > 0.1)
+		step = std::clamp((int)std::ceil(error * 4), 1, 4);
+	int next = std::clamp(current + step, min_quality_, max_quality_);
+	if (next != current)
+	{
+		LOG(3, "MjpegEncoder: averaging " << (uint64_t)frame_bytes_average_ << " bytes against " << (uint64_t)target
+										  << ", quality now " << next);
+		quality_.store(next, std::memory_order_relaxed);
+		frame_bytes_samples_ = 0;
 	}
 }
@@ -7,12 +7,18 @@
 
 #pragma once
 
-#include <condition_variable>
+#include <atomic>
+#include <chrono>
+#include <deque>
+#include <memory>
 #include <mutex>
-#include <queue>
 #include <thread>
+#include <vector>
+
+#include <semaphore.h>
 
 #include "encoder.hpp"
+#include "mpmc_queue.hpp"
 
 struct jpeg_compress_struct;
 
@@ -20,48 +26,255 @@ class MjpegEncoder : public Encoder
 {
 public:
 	MjpegEncoder(VideoOptions const *options);
+	MjpegEncoder(MJPEGOptions const *options);
 	~MjpegEncoder();
-	// Encode the given buffer.
+	// Encode the given buffer. If the queue is already at its maximum depth a frame is dropped
+	// and its input buffer handed straight back.
 	void EncodeBuffer(int fd, size_t size, void *mem, StreamInfo const &info, int64_t timestamp_us) override;
+	// Number of frames dropped so far because the encode queue was full.
+	uint64_t DroppedFrames();
+	// Each extra size (from MJPEGOptions::encode_sizes) is output through its own callback,
+	// straight after the full size version of the same frame.
+	unsigned int NumSizes() const { return sizes_.size(); }
+	void SetSizeOutputReadyCallback(unsigned int size, OutputReadyCallback callback);
+	// A disabled size isn't encoded for frames queued from then on. Call this from the thread that
+	// calls EncodeBuffer.
+	void SetSizeEnabled(unsigned int size, bool enabled);
+	// Encode just this part of each frame, as fractions of the frame size, rounded to whole MCUs. A
+	// zero width or height encodes the whole frame. Call this from the thread that calls EncodeBuffer.
+	void SetCrop(float x, float y, float width, float height);
 
 private:
-	// How many threads to use. Whichever thread is idle will pick up the next frame.
-	static const int NUM_ENC_THREADS = 4;
+	// Work out the thread count, CPU set and priority, then start the threads.
+	void startThreads();
 
-	// These threads do the actual encoding.
+	// These threads do the actual encoding. Whichever thread is idle will pick up the next frame.
 	void encodeThread(int num);
+	void setEncodeThreadPriority();
 
 	// Handle the output buffers in another thread so as not to block the encoders. The
 	// application can take its time, after which we return this buffer to the encoder for
 	// re-use.
 	void outputThread();
 
-	bool abortEncode_;
-	bool abortOutput_;
+	std::atomic<bool> abortEncode_;
+	std::atomic<bool> abortOutput_;
+	// Frames are numbered as they are queued, which is the order they must be output in.
 	uint64_t index_;
 
-	struct EncodeItem
+	// Luma and chroma Huffman tables.
+	struct HuffmanTable
+	{
+		uint8_t bits[17];
+		uint8_t huffval[256];
+	};
+	struct HuffmanTables
+	{
+		HuffmanTable dc[2];
+		HuffmanTable ac[2];
+	};
+
+	// Plane pointers of a YUV420 image. These may be a window onto a larger image, using its strides.
+	struct Planes
+	{
+		uint8_t *y;
+		uint8_t *u;
+		uint8_t *v;
+	};
+	static Planes imagePlanes(void *mem, StreamInfo const &info);
+
+	enum FrameState
+	{
+		Queued,
+		Claimed,
+		Dropped
+	};
+	// A frame shared by all the queue items for it. In strip mode a frame is cut into horizontal
+	// bands of whole MCU rows which are encoded concurrently, each one forming a single restart
+	// interval. Any extra sizes follow the strips as items of their own. Whichever thread finishes
+	// the last item joins the strips up into one JPEG and outputs everything.
+	struct Frame
 	{
 		void *mem;
+		// The part of the input being encoded, which info describes (with the input's stride).
+		Planes planes;
 		StreamInfo info;
 		int64_t timestamp_us;
 		uint64_t index;
+		int quality;
+		// Encode just the Y plane, as a single component JPEG.
+		bool grayscale;
+		// Encode with optimised Huffman tables, which later frames then reuse.
+		bool optimize_huffman;
+		// The shared Huffman tables when the frame was queued, so that all its strips use the same ones.
+		std::shared_ptr<HuffmanTables const> huffman_tables;
+		// An encode thread claims a frame when it takes any of its items; a frame can only be
+		// dropped from the queue while it is still unclaimed.
+		std::atomic<int> state;
+		unsigned int num_strips;
+		// Strips are a whole number of 16 row bands, whatever size the MCUs really are.
+		unsigned int mcu_rows_per_strip;
+		// With input staging, our own copy of the input buffer, which mem then points to.
+		std::vector<uint8_t> staging;
+		std::chrono::high_resolution_clock::time_point queue_time;
+		// The extra sizes (indices into sizes_) the frame is being encoded at.
+		std::vector<unsigned int> sizes;
+		// Results for each strip and then each extra size, when there is more than one item.
+		std::vector<std::vector<uint8_t>> buffers;
+		std::vector<size_t> bytes_used;
+		std::atomic<unsigned int> remaining;
+	};
+	unsigned int encode_strips_;
+	bool use_turbojpeg_;
+	// Input staging copies each frame into a recycled buffer of ordinary cached memory, so that the
+	// input buffer (and with it the camera request) goes back at once, and the encode threads don't
+	// read the DMA buffer at all.
+	bool staging_;
+	std::vector<uint8_t> getStagingBuffer(size_t size);
+	void returnStagingBuffer(std::vector<uint8_t> &&buffer);
+	std::mutex staging_pool_mutex_;
+	std::vector<std::vector<uint8_t>> staging_pool_;
+	// How long input buffers are held for, from EncodeBuffer until they are handed back. Only one
+	// thread adds to these: EncodeBuffer's with staging, otherwise the output thread.
+	double hold_time_total_ = 0;
+	uint64_t hold_frames_ = 0;
+
+	struct EncodeItem
+	{
+		std::shared_ptr<Frame> frame;
+		// Strip number, or num_strips onwards for the extra sizes.
+		unsigned int part;
+	};
+	// Encode items are handed to the threads through a lock-free queue, with a semaphore counting
+	// the items so that idle threads sleep until there is work.
+	std::unique_ptr<MpmcQueue<EncodeItem>> encode_queue_;
+	sem_t encode_sem_;
+	// Frames not yet claimed by an encode thread. Only EncodeBuffer, which is called from one
+	// thread at a time, looks at this.
+	std::deque<std::shared_ptr<Frame>> pending_frames_;
+	void dropOldestFrame();
+	unsigned int max_queue_depth_;
+	bool drop_newest_;
+	std::atomic<uint64_t> dropped_frames_;
+	uint64_t total_frames_;
+	// Rate control. With a target set, the output thread steers quality_ (within the min and max)
+	// so that the average frame size meets it. Each frame is encoded at whatever quality_ was when
+	// it was queued. Everything else here belongs to the output thread.
+	void updateRateControl(size_t bytes_used, int64_t timestamp_us, int quality);
+	std::atomic<int> quality_;
+	uint64_t target_frame_bytes_;
+	uint64_t target_byte_rate_;
+	int min_quality_;
+	int max_quality_;
+	// Grayscale mode. In auto mode the frames switch to grayscale once their chroma has stayed
+	// flat for a while, and back as soon as it isn't.
+	enum GrayscaleMode
+	{
+		GrayscaleOff,
+		GrayscaleOn,
+		GrayscaleAuto
+	};
+	bool chromaIsFlat(void *mem, StreamInfo const &info) const;
+	GrayscaleMode grayscale_mode_;
+	unsigned int grayscale_threshold_;
+	unsigned int flat_chroma_frames_;
+	// Every huffman_interval_ frames, one is encoded whole with optimised Huffman tables. These are
+	// padded out with codes for every other symbol and used for the frames queued after that.
+	void updateHuffmanTables(struct jpeg_compress_struct &cinfo, bool grayscale);
+	unsigned int huffman_interval_;
+	std::mutex huffman_mutex_;
+	std::shared_ptr<HuffmanTables const> huffman_tables_;
+	std::shared_ptr<HuffmanTables const> standard_huffman_tables_;
+	double frame_bytes_average_ = 0;
+	unsigned int frame_bytes_samples_ = 0;
+	double frame_interval_average_ = 0;
+	int64_t last_timestamp_us_ = 0;
+	// Achieved rate, overall and since the last report.
+	uint64_t output_bytes_ = 0;
+	uint64_t output_frames_ = 0;
+	int64_t first_timestamp_us_ = 0;
+	uint64_t report_bytes_ = 0;
+	uint64_t report_frames_ = 0;
+	int64_t report_timestamp_us_ = 0;
+	unsigned int num_enc_threads_;
+	std::vector<std::thread> encode_thread_;
+	// CPUs the encode threads are pinned to, if any were given.
+	std::vector<int> encode_cpus_;
+	int encode_nice_;
+	std::string encode_sched_;
+	// Extra sizes of each frame, box filtered down from the full frame by the encode threads. A
+	// size with no width is the full frame again, presumably at another quality.
+	struct Size
+	{
+		unsigned int width;
+		unsigned int height;
+		int quality;
+		bool enabled;
+		OutputReadyCallback output_ready_callback;
 	};
-	std::queue<EncodeItem> encode_queue_;
-	std::mutex encode_mutex_;
-	std::condition_variable encode_cond_var_;
-	std::thread encode_thread_[NUM_ENC_THREADS];
-	void encodeJPEG(struct jpeg_compress_struct &cinfo, EncodeItem &item, uint8_t *&encoded_buffer, size_t &buffer_len);
+	std::vector<Size> sizes_;
+	float crop_x_ = 0;
+	float crop_y_ = 0;
+	float crop_width_ = 0;
+	float crop_height_ = 0;
+	// What each thread's compressor was last set up for. Nothing about the compressor needs
+	// redoing between frames unless this changes (the image dimensions don't affect the tables,
+	// so are simply set for each image or strip).
+	struct CompressorConfig
+	{
+		int quality = -1;
+		bool grayscale = false;
+		std::shared_ptr<HuffmanTables const> huffman_tables;
+	};
+	void prepareCompressor(struct jpeg_compress_struct &cinfo, CompressorConfig &config, int quality, bool grayscale,
+						   std::shared_ptr<HuffmanTables const> const &huffman_tables);
+	void stripRows(Frame const &frame, unsigned int strip, unsigned int &first_row, unsigned int &height);
+	// Encode rows first_row to first_row + height of the YUV420 image in planes.
+	void encodeJPEG(struct jpeg_compress_struct &cinfo, CompressorConfig &config, Frame const &frame, int quality,
+					bool optimize, Planes const &planes, StreamInfo const &info, unsigned int first_row,
+					unsigned int height, std::vector<uint8_t> &buffer, size_t &bytes_used);
+#if TURBOJPEG_PRESENT
+	// The alternative TurboJPEG backend, compressing straight from the planes with a handle
+	// belonging to the calling thread.
+	void encodeTurboJPEG(void *handle, int quality, bool grayscale, Planes const &planes, StreamInfo const &info,
+						 unsigned int first_row, unsigned int height, std::vector<uint8_t> &buffer, size_t &bytes_used);
+#endif
+	void joinStrips(Frame &frame, std::vector<uint8_t> &buffer, size_t &bytes_used);
+
+	// Output buffers are recycled rather than allocated for every frame. New buffers are sized
+	// from the recent frame sizes, so once these settle encoding does no allocation at all.
+	std::vector<uint8_t> getOutputBuffer(StreamInfo const &info);
+	void returnOutputBuffer(std::vector<uint8_t> &&buffer, size_t bytes_used);
+	std::mutex buffer_pool_mutex_;
+	std::vector<std::vector<uint8_t>> buffer_pool_;
+	size_t buffer_size_estimate_;
 
+	// Finished frames go into the output ring at their index, so the output thread just waits for
+	// the next slot to fill rather than searching for it. Dropped frames fill their slot with an
+	// empty item. The ring can't overflow because EncodeBuffer waits for a free slot (counted by
+	// output_space_sem_) before queueing each frame.
+	static constexpr unsigned int OUTPUT_RING_SIZE = 64;
 	struct OutputItem
 	{
 		void *mem;
+		std::vector<uint8_t> buffer;
 		size_t bytes_used;
 		int64_t timestamp_us;
-		uint64_t index;
+		int quality;
+		std::chrono::high_resolution_clock::time_point queue_time;
+		// One for each of sizes_, left empty for those not encoded.
+		std::vector<std::vector<uint8_t>> size_buffers;
+		std::vector<size_t> size_bytes_used;
+	};
+	struct OutputSlot
+	{
+		// index + 1 once the item for index is ready.
+		std::atomic<uint64_t> sequence;
+		OutputItem item;
 	};
-	std::queue<OutputItem> output_queue_[NUM_ENC_THREADS];
-	std::mutex output_mutex_;
-	std::condition_variable output_cond_var_;
+	void publishOutput(uint64_t index, OutputItem &&item);
+	std::unique_ptr<OutputSlot[]> output_ring_;
+	sem_t output_sem_;
+	sem_t output_space_sem_;
 	std::thread output_thread_;
 };
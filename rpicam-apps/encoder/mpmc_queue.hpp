@@ -0,0 +1,99 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * mpmc_queue.hpp - bounded lock-free multi-producer multi-consumer queue.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstddef>
+#include <cstdint>
+#include <memory>
+
+// Dmitry Vyukov's bounded MPMC queue. Each cell carries a sequence number that tells producers
+// and consumers whether it is free for the position they have claimed, so a push or pop is one
+// compare-and-swap on the shared position plus a store to the cell. Neither call ever blocks;
+// callers that need to sleep pair the queue with a semaphore.
+template <typename T>
+class MpmcQueue
+{
+public:
+	// The capacity is rounded up to a power of 2.
+	explicit MpmcQueue(size_t capacity)
+	{
+		size_t size = 2;
+		while (size < capacity)
+			size *= 2;
+		mask_ = size - 1;
+		cells_ = std::make_unique<Cell[]>(size);
+		for (size_t i = 0; i < size; i++)
+			cells_[i].sequence.store(i, std::memory_order_relaxed);
+		enqueue_pos_.store(0, std::memory_order_relaxed);
+		dequeue_pos_.store(0, std::memory_order_relaxed);
+	}
+
+	size_t Capacity() const { return mask_ + 1; }
+
+	// Returns false if the queue is full.
+	bool TryPush(T &&value)
+	{
+		size_t pos = enqueue_pos_.load(std::memory_order_relaxed);
+		Cell *cell;
+		while (true)
+		{
+			cell = &cells_[pos & mask_];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)pos;
+			if (diff == 0)
+			{
+				if (enqueue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = enqueue_pos_.load(std::memory_order_relaxed);
+		}
+		cell->data = std::move(value);
+		cell->sequence.store(pos + 1, std::memory_order_release);
+		return true;
+	}
+
+	// Returns false if the queue is empty.
+	bool TryPop(T &value)
+	{
+		size_t pos = dequeue_pos_.load(std::memory_order_relaxed);
+		Cell *cell;
+		while (true)
+		{
+			cell = &cells_[pos & mask_];
+			size_t seq = cell->sequence.load(std::memory_order_acquire);
+			intptr_t diff = (intptr_t)seq - (intptr_t)(pos + 1);
+			if (diff == 0)
+			{
+				if (dequeue_pos_.compare_exchange_weak(pos, pos + 1, std::memory_order_relaxed))
+					break;
+			}
+			else if (diff < 0)
+				return false;
+			else
+				pos = dequeue_pos_.load(std::memory_order_relaxed);
+		}
+		value = std::move(cell->data);
+		cell->sequence.store(pos + mask_ + 1, std::memory_order_release);
+		return true;
+	}
+
+private:
+	struct Cell
+	{
+		std::atomic<size_t> sequence;
+		T data;
+	};
+
+	std::unique_ptr<Cell[]> cells_;
+	size_t mask_;
+	// Keep the two positions on separate cache lines so producers and consumers don't contend.
+	alignas(64) std::atomic<size_t> enqueue_pos_;
+	alignas(64) std::atomic<size_t> dequeue_pos_;
+};
@@ -21,6 +21,9 @@ struct StillOptions;
 void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 			   libcamera::ControlList const &metadata, std::string const &filename, std::string const &cam_model,
 			   StillOptions const *options);
+// Write out a JPEG that has already been encoded, adding the same EXIF data as jpeg_save (but no thumbnail).
+void jpeg_save_encoded(uint8_t const *jpeg, size_t jpeg_len, libcamera::ControlList const &metadata,
+					   std::string const &filename, std::string const &cam_model, StillOptions const *options);
 
 // In yuv.cpp:
 void yuv_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
@@ -437,7 +437,7 @@ static void YUV_to_JPEG(const uint8_t *input, StreamInfo const &info, const int
 static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo const &info,
 							 ControlList const &metadata, std::string const &cam_model, StillOptions const *options,
 							 uint8_t *&exif_buffer, unsigned int &exif_len, uint8_t *&thumb_buffer,
-							 jpeg_mem_len_t &thumb_len)
+							 jpeg_mem_len_t &thumb_len, bool thumbnail = true)
 {
 	exif_buffer = nullptr;
 	ExifData *exif = nullptr;
@@ -504,7 +504,7 @@ static void create_exif_data(std::vector<libcamera::Span<uint8_t>> const &mem, S
 			exif_read_tag(exif, exif_item.c_str());
 		}
 
-		if (options->thumb_quality)
+		if (thumbnail && options->thumb_quality)
 		{
 			// Add some tags for the thumbnail. We put in dummy values for the thumbnail
 			// offset/length to occupy the right amount of space, and fill them in later.
@@ -634,3 +634,52 @@ void jpeg_save(std::vector<libcamera::Span<uint8_t>> const &mem, StreamInfo cons
 		throw;
 	}
 }
+
+void jpeg_save_encoded(uint8_t const *jpeg, size_t jpeg_len, ControlList const &metadata, std::string const &filename,
+					   std::string const &cam_model, StillOptions const *options)
+{
+	FILE *fp = nullptr;
+	unsigned char *exif_buffer = nullptr;
+	uint8_t *thumb_buffer = nullptr;
+
+	try
+	{
+		// Our EXIF segment goes in place of the SOI marker and any JFIF segment following it.
+		if (jpeg_len < 6 || jpeg[0] != 0xff || jpeg[1] != 0xd8)
+			throw std::runtime_error("not a JPEG image");
+		size_t offset = 2;
+		if (jpeg[2] == 0xff && jpeg[3] == 0xe0)
+			offset += 2 + ((jpeg[4] << 8) | jpeg[5]);
+		if (offset >= jpeg_len)
+			throw std::runtime_error("truncated JPEG image");
+
+		// There's no thumbnail, as we have nothing to make one from (and the image is small anyway).
+		jpeg_mem_len_t thumb_len = 0;
+		unsigned int exif_len;
+		create_exif_data({}, StreamInfo(), metadata, cam_model, options, exif_buffer, exif_len, thumb_buffer,
+						 thumb_len, false);
+
+		fp = filename == "-" ? stdout : fopen(filename.c_str(), "w");
+		if (!fp)
+			throw std::runtime_error("failed to open file " + filename);
+
+		if (fwrite(exif_header, sizeof(exif_header), 1, fp) != 1 || fputc((exif_len + 2) >> 8, fp) == EOF ||
+			fputc((exif_len + 2) & 0xff, fp) == EOF || fwrite(exif_buffer, exif_len, 1, fp) != 1 ||
+			fwrite(jpeg + offset, jpeg_len - offset, 1, fp) != 1)
+			throw std::runtime_error("failed to write file - output probably corrupt");
+
+		if (fp != stdout)
+			fclose(fp);
+		fp = nullptr;
+
+		free(exif_buffer);
+		exif_buffer = nullptr;
+	}
+	catch (std::exception const &e)
+	{
+		if (fp && fp != stdout)
+			fclose(fp);
+		free(exif_buffer);
+		throw;
+	}
+}
@@ -0,0 +1,400 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * container_output.cpp - Write JPEG frames into an AVI or Matroska file.
+ */
+
+#include <algorithm>
+#include <cstring>
+#include <stdexcept>
+
+#include "container_output.hpp"
+
+// Keep AVI files within what readers using signed 32-bit offsets can handle.
+static constexpr uint64_t AVI_MAX_SIZE = 0x7fffffff;
+static constexpr int64_t MKV_CLUSTER_MS = 1000;
+
+static void put_le(std::vector<uint8_t> &v, uint64_t value, unsigned int bytes)
+{
+	for (unsigned int i = 0; i < bytes; i++)
+		v.push_back(value >> (8 * i));
+}
+
+static void put_be(std::vector<uint8_t> &v, uint64_t value, unsigned int bytes)
+{
+	for (unsigned int i = bytes; i > 0; i--)
+		v.push_back(value >> (8 * (i - 1)));
+}
+
+static void put_fourcc(std::vector<uint8_t> &v, char const *fourcc)
+{
+	v.insert(v.end(), fourcc, fourcc + 4);
+}
+
+// EBML element IDs are written as they are, including their length marker bits.
+static void put_ebml_id(std::vector<uint8_t> &v, uint32_t id)
+{
+	put_be(v, id, id > 0xffffff ? 4 : id > 0xffff ? 3 : id > 0xff ? 2 : 1);
+}
+
+// An element size, either in the fewest bytes or, so that it can be filled in later, in eight.
+static void put_ebml_size(std::vector<uint8_t> &v, uint64_t size, bool fixed = false)
+{
+	unsigned int bytes = 8;
+	while (!fixed && bytes > 1 && size < (1ULL << (7 * (bytes - 1))) - 1)
+		bytes--;
+	put_be(v, size | (1ULL << (7 * bytes)), bytes);
+}
+
+static void put_ebml_uint(std::vector<uint8_t> &v, uint32_t id, uint64_t value)
+{
+	unsigned int bytes = 1;
+	while (bytes < 8 && value >> (8 * bytes))
+		bytes++;
+	put_ebml_id(v, id);
+	put_ebml_size(v, bytes);
+	put_be(v, value, bytes);
+}
+
+static void put_ebml_string(std::vector<uint8_t> &v, uint32_t id, std::string const &value)
+{
+	put_ebml_id(v, id);
+	put_ebml_size(v, value.size());
+	v.insert(v.end(), value.begin(), value.end());
+}
+
+static void put_ebml_float(std::vector<uint8_t> &v, uint32_t id, double value)
+{
+	uint64_t bits;
+	memcpy(&bits, &value, sizeof(bits));
+	put_ebml_id(v, id);
+	put_ebml_size(v, 8);
+	put_be(v, bits, 8);
+}
+
+static void put_ebml_master(std::vector<uint8_t> &v, uint32_t id, std::vector<uint8_t> const &children)
+{
+	put_ebml_id(v, id);
+	put_ebml_size(v, children.size());
+	v.insert(v.end(), children.begin(), children.end());
+}
+
+// Find the image dimensions in a JPEG's SOF marker.
+static bool jpeg_dimensions(uint8_t const *jpeg, size_t size, unsigned int &width, unsigned int &height)
+{
+	size_t i = 2;
+	while (i + 9 <= size && jpeg[i] == 0xff)
+	{
+		uint8_t marker = jpeg[i + 1];
+		if (marker >= 0xc0 && marker <= 0xcf && marker != 0xc4 && marker != 0xc8 && marker != 0xcc)
+		{
+			height = (jpeg[i + 5] << 8) | jpeg[i + 6];
+			width = (jpeg[i + 7] << 8) | jpeg[i + 8];
+			return true;
+		}
+		if (marker == 0xda)
+			break;
+		i += 2 + ((jpeg[i + 2] << 8) | jpeg[i + 3]);
+	}
+	return false;
+}
+
+ContainerOutput::ContainerOutput(VideoOptions const *options)
+	: Output(options), fp_(nullptr), matroska_(false), full_(false), width_(0), height_(0), frames_(0),
+	  first_timestamp_us_(0), last_timestamp_us_(0), max_frame_size_(0), avi_movi_pos_(0), mkv_segment_pos_(0),
+	  mkv_duration_pos_(0), mkv_cluster_pos_(0), mkv_cluster_time_ms_(0)
+{
+}
+
+ContainerOutput::~ContainerOutput()
+{
+	try
+	{
+		closeFile();
+	}
+	catch (std::exception const &e)
+	{
+		LOG_ERROR("ERROR: failed to finish " << options_->output << ": " << e.what());
+	}
+}
+
+void ContainerOutput::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	uint8_t const *jpeg = (uint8_t const *)mem;
+	if (!fp_)
+		openFile(jpeg, size);
+	if (full_)
+		return;
+
+	if (!frames_)
+		first_timestamp_us_ = timestamp_us;
+	last_timestamp_us_ = timestamp_us;
+	max_frame_size_ = std::max(max_frame_size_, size);
+
+	if (matroska_)
+		writeMkvFrame(jpeg, size, timestamp_us);
+	else
+		writeAviFrame(jpeg, size);
+
+	LOG(2, "ContainerOutput: output buffer " << mem << " size " << size);
+	if (options_->flush)
+		fflush(fp_);
+}
+
+void ContainerOutput::openFile(uint8_t const *jpeg, size_t size)
+{
+	if (!jpeg_dimensions(jpeg, size, width_, height_))
+		throw std::runtime_error("ContainerOutput: frame is not a JPEG image");
+
+	std::string const &filename = options_->output;
+	matroska_ = filename.size() >= 4 && filename.compare(filename.size() - 4, 4, ".mkv") == 0;
+	fp_ = fopen(filename.c_str(), "w");
+	if (!fp_)
+		throw std::runtime_error("failed to open output file " + filename);
+	LOG(2, "ContainerOutput: opened " << (matroska_ ? "Matroska" : "AVI") << " file " << filename << " for "
+									 << width_ << "x" << height_ << " frames");
+
+	if (matroska_)
+		writeMkvHeader();
+	else
+	{
+		write(aviHeader());
+		avi_movi_pos_ = ftello(fp_) - 4;
+	}
+}
+
+void ContainerOutput::closeFile()
+{
+	if (!fp_)
+		return;
+
+	if (matroska_)
+		finishMkv();
+	else
+		finishAvi();
+	fclose(fp_);
+	fp_ = nullptr;
+	LOG(2, "ContainerOutput: closed " << options_->output << " after " << frames_ << " frames");
+}
+
+void ContainerOutput::write(std::vector<uint8_t> const &data)
+{
+	if (fwrite(data.data(), data.size(), 1, fp_) != 1)
+		throw std::runtime_error("failed to write output bytes");
+}
+
+void ContainerOutput::writeAt(off_t pos, std::vector<uint8_t> const &data)
+{
+	off_t end = ftello(fp_);
+	if (end < 0 || fseeko(fp_, pos, SEEK_SET) < 0)
+		throw std::runtime_error("failed to seek in output file");
+	write(data);
+	if (fseeko(fp_, end, SEEK_SET) < 0)
+		throw std::runtime_error("failed to seek in output file");
+}
+
+std::vector<uint8_t> ContainerOutput::aviHeader(uint32_t riff_size, uint32_t movi_size) const
+{
+	// Readers take the frames to be evenly spaced, so use the average interval.
+	uint32_t frame_us = frames_ > 1 ? (last_timestamp_us_ - first_timestamp_us_) / (frames_ - 1) : 33333;
+	uint32_t suggested_size = max_frame_size_ + 8;
+	std::vector<uint8_t> v;
+
+	put_fourcc(v, "RIFF");
+	put_le(v, riff_size, 4);
+	put_fourcc(v, "AVI ");
+	put_fourcc(v, "LIST");
+	put_le(v, 192, 4);
+	put_fourcc(v, "hdrl");
+
+	put_fourcc(v, "avih");
+	put_le(v, 56, 4);
+	put_le(v, frame_us, 4);
+	put_le(v, 0, 4); // max bytes per second
+	put_le(v, 0, 4); // padding granularity
+	put_le(v, 0x10, 4); // AVIF_HASINDEX
+	put_le(v, frames_, 4);
+	put_le(v, 0, 4); // initial frames
+	put_le(v, 1, 4); // streams
+	put_le(v, suggested_size, 4);
+	put_le(v, width_, 4);
+	put_le(v, height_, 4);
+	v.insert(v.end(), 16, 0); // reserved
+
+	put_fourcc(v, "LIST");
+	put_le(v, 116, 4);
+	put_fourcc(v, "strl");
+	put_fourcc(v, "strh");
+	put_le(v, 56, 4);
+	put_fourcc(v, "vids");
+	put_fourcc(v, "MJPG");
+	put_le(v, 0, 4); // flags
+	put_le(v, 0, 4); // priority and language
+	put_le(v, 0, 4); // initial frames
+	put_le(v, frame_us, 4); // scale
+	put_le(v, 1000000, 4); // rate
+	put_le(v, 0, 4); // start
+	put_le(v, frames_, 4);
+	put_le(v, suggested_size, 4);
+	put_le(v, 0xffffffff, 4); // quality
+	put_le(v, 0, 4); // sample size
+	put_le(v, 0, 4); // frame rectangle left, top
+	put_le(v, width_, 2);
+	put_le(v, height_, 2);
+
+	put_fourcc(v, "strf");
+	put_le(v, 40, 4);
+	put_le(v, 40, 4);
+	put_le(v, width_, 4);
+	put_le(v, height_, 4);
+	put_le(v, 1, 2); // planes
+	put_le(v, 24, 2); // bit count
+	put_fourcc(v, "MJPG");
+	put_le(v, width_ * height_ * 3, 4);
+	v.insert(v.end(), 16, 0); // resolution and colours
+
+	put_fourcc(v, "LIST");
+	put_le(v, movi_size, 4);
+	put_fourcc(v, "movi");
+	return v;
+}
+
+void ContainerOutput::writeAviFrame(uint8_t const *jpeg, size_t size)
+{
+	// Leave room for the index, which needs 16 bytes for every frame.
+	off_t pos = ftello(fp_);
+	size_t padded = (size + 1) & ~1;
+	if (pos + 8 + padded + 8 + 16 * (avi_index_.size() + 1) > AVI_MAX_SIZE)
+	{
+		LOG_ERROR("WARNING: " << options_->output << " has reached the AVI size limit, use .mkv for longer recordings");
+		full_ = true;
+		return;
+	}
+
+	std::vector<uint8_t> chunk;
+	put_fourcc(chunk, "00dc");
+	put_le(chunk, size, 4);
+	write(chunk);
+	if (fwrite(jpeg, size, 1, fp_) != 1 || (padded != size && fputc(0, fp_) == EOF))
+		throw std::runtime_error("failed to write output bytes");
+	avi_index_.push_back({ (uint32_t)(pos - avi_movi_pos_), (uint32_t)size });
+	frames_++;
+}
+
+void ContainerOutput::finishAvi()
+{
+	off_t movi_end = ftello(fp_);
+	std::vector<uint8_t> index;
+	put_fourcc(index, "idx1");
+	put_le(index, avi_index_.size() * 16, 4);
+	for (auto const &entry : avi_index_)
+	{
+		put_fourcc(index, "00dc");
+		put_le(index, 0x10, 4); // AVIIF_KEYFRAME
+		put_le(index, entry.offset, 4);
+		put_le(index, entry.size, 4);
+	}
+	write(index);
+	off_t end = ftello(fp_);
+
+	writeAt(0, aviHeader(end - 8, movi_end - avi_movi_pos_));
+}
+
+void ContainerOutput::writeMkvHeader()
+{
+	std::vector<uint8_t> ebml, v;
+	put_ebml_uint(ebml, 0x4286, 1); // EBMLVersion
+	put_ebml_uint(ebml, 0x42f7, 1); // EBMLReadVersion
+	put_ebml_uint(ebml, 0x42f2, 4); // EBMLMaxIDLength
+	put_ebml_uint(ebml, 0x42f3, 8); // EBMLMaxSizeLength
+	put_ebml_string(ebml, 0x4282, "matroska"); // DocType
+	put_ebml_uint(ebml, 0x4287, 4); // DocTypeVersion
+	put_ebml_uint(ebml, 0x4285, 2); // DocTypeReadVersion
+	put_ebml_master(v, 0x1a45dfa3, ebml);
+
+	// The segment size is unknown until we finish.
+	put_ebml_id(v, 0x18538067);
+	put_ebml_size(v, 0xffffffffffffffULL, true);
+	write(v);
+	mkv_segment_pos_ = ftello(fp_);
+
+	std::vector<uint8_t> info, tracks, track, video;
+	put_ebml_uint(info, 0x2ad7b1, 1000000); // TimestampScale, for millisecond timestamps
+	put_ebml_string(info, 0x4d80, "rpicam-apps"); // MuxingApp
+	put_ebml_string(info, 0x5741, "rpicam-apps"); // WritingApp
+	size_t duration_offset = info.size();
+	put_ebml_float(info, 0x4489, 0); // Duration, filled in by finishMkv
+
+	put_ebml_uint(video, 0xb0, width_); // PixelWidth
+	put_ebml_uint(video, 0xba, height_); // PixelHeight
+	put_ebml_uint(track, 0xd7, 1); // TrackNumber
+	put_ebml_uint(track, 0x73c5, 1); // TrackUID
+	put_ebml_uint(track, 0x83, 1); // TrackType, video
+	put_ebml_uint(track, 0x9c, 0); // FlagLacing
+	put_ebml_string(track, 0x86, "V_MJPEG"); // CodecID
+	put_ebml_master(track, 0xe0, video);
+	put_ebml_master(tracks, 0xae, track);
+
+	v.clear();
+	put_ebml_master(v, 0x1549a966, info);
+	// Skip the Info element's ID and size, and then the Duration's.
+	mkv_duration_pos_ = mkv_segment_pos_ + (v.size() - info.size()) + duration_offset + 3;
+	put_ebml_master(v, 0x1654ae6b, tracks);
+	write(v);
+}
+
+void ContainerOutput::writeMkvFrame(uint8_t const *jpeg, size_t size, int64_t timestamp_us)
+{
+	int64_t time_ms = (timestamp_us - first_timestamp_us_) / 1000;
+	if (!mkv_cluster_pos_ || time_ms - mkv_cluster_time_ms_ >= MKV_CLUSTER_MS)
+	{
+		closeMkvCluster();
+		std::vector<uint8_t> cluster;
+		put_ebml_id(cluster, 0x1f43b675);
+		put_ebml_size(cluster, 0xffffffffffffffULL, true);
+		mkv_cluster_pos_ = ftello(fp_) + cluster.size();
+		put_ebml_uint(cluster, 0xe7, time_ms); // Timestamp
+		write(cluster);
+		mkv_cluster_time_ms_ = time_ms;
+	}
+
+	std::vector<uint8_t> block;
+	put_ebml_id(block, 0xa3); // SimpleBlock
+	put_ebml_size(block, size + 4);
+	block.push_back(0x81); // track number
+	put_be(block, time_ms - mkv_cluster_time_ms_, 2);
+	block.push_back(0x80); // keyframe
+	write(block);
+	if (fwrite(jpeg, size, 1, fp_) != 1)
+		throw std::runtime_error("failed to write output bytes");
+	frames_++;
+}
+
+void ContainerOutput::closeMkvCluster()
+{
+	if (!mkv_cluster_pos_)
+		return;
+	std::vector<uint8_t> size;
+	put_ebml_size(size, ftello(fp_) - mkv_cluster_pos_, true);
+	writeAt(mkv_cluster_pos_ - size.size(), size);
+	mkv_cluster_pos_ = 0;
+}
+
+void ContainerOutput::finishMkv()
+{
+	closeMkvCluster();
+
+	std::vector<uint8_t> size, duration;
+	put_ebml_size(size, ftello(fp_) - mkv_segment_pos_, true);
+	writeAt(mkv_segment_pos_ - size.size(), size);
+
+	// Let the last frame last as long as the average one.
+	double duration_ms = (last_timestamp_us_ - first_timestamp_us_) / 1000.0;
+	if (frames_ > 1)
+		duration_ms += duration_ms / (frames_ - 1);
+	uint64_t bits;
+	memcpy(&bits, &duration_ms, sizeof(bits));
+	put_be(duration, bits, 8);
+	writeAt(mkv_duration_pos_, duration);
+}
@@ -0,0 +1,69 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * container_output.hpp - Write JPEG frames into an AVI or Matroska file.
+ */
+
+#pragma once
+
+#include <vector>
+
+#include <sys/types.h>
+
+#include "output.hpp"
+
+// Muxes already encoded JPEG frames into a video file, without any transcoding. The container is
+// chosen from the file name: Matroska for ".mkv", otherwise AVI. The file is only opened when the
+// first frame arrives, as its dimensions come from that frame.
+class ContainerOutput : public Output
+{
+public:
+	ContainerOutput(VideoOptions const *options);
+	~ContainerOutput();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	void openFile(uint8_t const *jpeg, size_t size);
+	void closeFile();
+	void write(std::vector<uint8_t> const &data);
+	void writeAt(off_t pos, std::vector<uint8_t> const &data);
+
+	// AVI files have a fixed size header which is written again with the real frame count and
+	// rate when the file is closed, followed by an index of the frames.
+	std::vector<uint8_t> aviHeader(uint32_t riff_size = 0, uint32_t movi_size = 0) const;
+	void writeAviFrame(uint8_t const *jpeg, size_t size);
+	void finishAvi();
+	// Matroska files use millisecond timestamps, so keep the real timing of each frame. Element
+	// sizes are filled in as each cluster, and finally the segment, is finished.
+	void writeMkvHeader();
+	void writeMkvFrame(uint8_t const *jpeg, size_t size, int64_t timestamp_us);
+	void closeMkvCluster();
+	void finishMkv();
+
+	FILE *fp_;
+	bool matroska_;
+	// Once an AVI file reaches its size limit, further frames are dropped.
+	bool full_;
+	unsigned int width_;
+	unsigned int height_;
+	uint64_t frames_;
+	int64_t first_timestamp_us_;
+	int64_t last_timestamp_us_;
+	size_t max_frame_size_;
+
+	struct AviIndexEntry
+	{
+		uint32_t offset;
+		uint32_t size;
+	};
+	std::vector<AviIndexEntry> avi_index_;
+	off_t avi_movi_pos_;
+
+	off_t mkv_segment_pos_;
+	off_t mkv_duration_pos_;
+	off_t mkv_cluster_pos_;
+	int64_t mkv_cluster_time_ms_;
+};
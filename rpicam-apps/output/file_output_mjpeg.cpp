@@ -5,20 +5,75 @@
  * file_output.cpp - Write output to file.
  */
 
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+
+#include <fcntl.h>
+#include <stdio.h>
+#include <unistd.h>
+
 #include "file_output_mjpeg.hpp"
 
+static void write_all(int fd, void const *mem, size_t size, off_t offset)
+{
+	uint8_t const *ptr = (uint8_t const *)mem;
+	while (size)
+	{
+		ssize_t n = pwrite(fd, ptr, size, offset);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			throw std::runtime_error("failed to write output bytes: " + std::string(strerror(errno)));
+		ptr += n;
+		size -= n;
+		offset += n;
+	}
+}
+
 FileOutputMJPEG::FileOutputMJPEG(VideoOptions const *options, RPiCamMJPEGEncoder *encoder)
-    : Output(options), fp_(nullptr), file_start_time_ms_(0), count_(0), encoder_(encoder)
+    : Output(options), fp_(nullptr), file_start_time_ms_(0), count_(0), encoder_(encoder), publish_(PublishRename),
+	  dir_fd_(-1)
 {
+	std::string const &publish = encoder_->GetOptions()->preview_publish;
+	std::string const &output = options_->output;
+	if (publish == "rename")
+		return;
+	// Only a plain ".tmp" file name can be published like this.
+	if (output == "-" || output.find('%') != std::string::npos || output.size() < 4 ||
+		output.substr(output.size() - 4) != ".tmp")
+	{
+		LOG_ERROR("WARNING: can't publish " << output << " with \"" << publish << "\", renaming instead");
+		return;
+	}
+
+	std::filesystem::path path(output);
+	std::string dir = path.has_parent_path() ? path.parent_path().string() : ".";
+	dir_fd_ = open(dir.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+	if (dir_fd_ < 0)
+		throw std::runtime_error("failed to open output directory " + dir);
+	tmp_name_ = path.filename().string();
+	name_ = tmp_name_.substr(0, tmp_name_.size() - 4);
+	// A .tmp file left behind earlier would be renamed over the real one when we finish.
+	unlinkat(dir_fd_, tmp_name_.c_str(), 0);
+
+	publish_ = PublishTmpfile;
+	LOG(2, "FileOutputMJPEG: publishing " << name_ << " in " << dir << " with " << publish);
 }
 
 FileOutputMJPEG::~FileOutputMJPEG()
 {
+	if (dir_fd_ >= 0)
+		close(dir_fd_);
 	closeFile();
 }
 
 void FileOutputMJPEG::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
 {
+	// Each preview buffer is a whole JPEG, so the faster mode publishes every one as it arrives.
+	if (publish_ == PublishTmpfile && publishTmpfile(mem, size))
+		return;
+
 	// We need to open a new file if we're in "segment" mode and our segment is full
 	// (though we have to wait for the next I frame), or if we're in "split" mode
 	// and recording is being restarted (this is necessarily an I-frame already).
@@ -66,6 +121,42 @@ void FileOutputMJPEG::openFile(int64_t timestamp_us)
 	}
 }
 
+bool FileOutputMJPEG::publishTmpfile(void *mem, size_t size)
+{
+	int fd = openat(dir_fd_, ".", O_TMPFILE | O_WRONLY | O_CLOEXEC, 0644);
+	if (fd < 0)
+	{
+		if (errno != EOPNOTSUPP && errno != EISDIR && errno != EINVAL)
+			throw std::runtime_error("failed to create output file: " + std::string(strerror(errno)));
+		LOG_ERROR("WARNING: O_TMPFILE is not supported for " << name_ << ", renaming instead");
+		publish_ = PublishRename;
+		return false;
+	}
+
+	try
+	{
+		write_all(fd, mem, size, 0);
+		// linkat won't replace an existing file, so the finished file gets the temporary name and is
+		// then renamed over the real one. Linking through /proc needs no special privileges.
+		std::string proc_path = "/proc/self/fd/" + std::to_string(fd);
+		int ret = linkat(AT_FDCWD, proc_path.c_str(), dir_fd_, tmp_name_.c_str(), AT_SYMLINK_FOLLOW);
+		if (ret < 0 && errno == EEXIST)
+		{
+			unlinkat(dir_fd_, tmp_name_.c_str(), 0);
+			ret = linkat(AT_FDCWD, proc_path.c_str(), dir_fd_, tmp_name_.c_str(), AT_SYMLINK_FOLLOW);
+		}
+		if (ret < 0 || renameat(dir_fd_, tmp_name_.c_str(), dir_fd_, name_.c_str()) < 0)
+			throw std::runtime_error("failed to publish " + name_ + ": " + std::string(strerror(errno)));
+	}
+	catch (std::exception const &)
+	{
+		close(fd);
+		throw;
+	}
+	close(fd);
+	return true;
+}
+
 void FileOutputMJPEG::closeFile()
 {
 	if (fp_)
@@ -78,5 +169,5 @@ void FileOutputMJPEG::closeFile()
 		fp_ = nullptr;
 	}
 	
-    encoder_->MoveTempMJPEGOutput();
+    encoder_->MoveTempMJPEGOutput(options_->output);
 }
@@ -7,6 +7,8 @@
 
 #pragma once
 
+#include <string>
+
 #include "output.hpp"
 
 class FileOutputMJPEG : public Output
@@ -26,4 +28,18 @@ private:
 	unsigned int count_;
     RPiCamMJPEGEncoder *encoder_;
 
+	// Besides the default of writing a .tmp file and renaming it, each frame can be published with
+	// fewer syscalls through a directory fd that stays open: "tmpfile" writes an unnamed file and
+	// links it into place. Anyone opening the output name always gets a complete JPEG. If the
+	// filesystem can't do it, we fall back to renaming.
+	enum Publish
+	{
+		PublishRename,
+		PublishTmpfile
+	};
+	bool publishTmpfile(void *mem, size_t size);
+	Publish publish_;
+	int dir_fd_;
+	std::string name_;
+	std::string tmp_name_;
 };
@@ -0,0 +1,284 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * http_output_mjpeg.cpp - Serve the preview JPEGs as a multipart MJPEG stream over HTTP.
+ */
+
+#include <cerrno>
+#include <cstring>
+
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "http_output_mjpeg.hpp"
+
+static constexpr unsigned int MAX_CLIENTS = 32;
+static constexpr size_t MAX_REQUEST_SIZE = 8192;
+
+static char const RESPONSE[] = "HTTP/1.0 200 OK\r\n"
+							   "Content-Type: multipart/x-mixed-replace; boundary=frame\r\n"
+							   "Cache-Control: no-cache, no-store\r\n"
+							   "Pragma: no-cache\r\n"
+							   "Connection: close\r\n"
+							   "\r\n";
+static char const BAD_REQUEST[] = "HTTP/1.0 405 Method Not Allowed\r\nConnection: close\r\n\r\n";
+
+HttpOutputMJPEG::HttpOutputMJPEG(VideoOptions const *options)
+	: Output(options), listen_fd_(-1), epoll_fd_(-1), event_fd_(-1), abort_(false), num_clients_(0),
+	  sequence_(0)
+{
+	int a, b, c, d, port, end = 0;
+	if (sscanf(options->output.c_str(), "http://%d.%d.%d.%d:%d%n", &a, &b, &c, &d, &port, &end) != 5 ||
+		end != (int)options->output.size() || port <= 0 || port > 65535)
+		throw std::runtime_error("bad http address " + options->output);
+	std::string address = std::to_string(a) + "." + std::to_string(b) + "." + std::to_string(c) + "." +
+						  std::to_string(d);
+
+	sockaddr_in saddr = {};
+	saddr.sin_family = AF_INET;
+	saddr.sin_port = htons(port);
+	if (inet_aton(address.c_str(), &saddr.sin_addr) == 0)
+		throw std::runtime_error("inet_aton failed for " + address);
+
+	listen_fd_ = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open http listen socket");
+	int enable = 1;
+	if (setsockopt(listen_fd_, SOL_SOCKET, SO_REUSEADDR, &enable, sizeof(enable)) < 0 ||
+		bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) < 0 || listen(listen_fd_, 8) < 0)
+	{
+		close(listen_fd_);
+		throw std::runtime_error("failed to listen on " + address + ":" + std::to_string(port) + ": " +
+								 strerror(errno));
+	}
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+	{
+		for (int fd : { epoll_fd_, event_fd_, listen_fd_ })
+		{
+			if (fd >= 0)
+				close(fd);
+		}
+		throw std::runtime_error("failed to create http server epoll fds");
+	}
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event);
+	event.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event);
+
+	server_thread_ = std::thread(&HttpOutputMJPEG::serverThread, this);
+	LOG(2, "HttpOutputMJPEG: serving on " << address << ":" << port);
+}
+
+HttpOutputMJPEG::~HttpOutputMJPEG()
+{
+	abort_ = true;
+	uint64_t value = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &value, sizeof(value));
+	server_thread_.join();
+	for (auto const &[fd, client] : clients_)
+		close(fd);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+}
+
+void HttpOutputMJPEG::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// Nobody to send it to, so don't bother copying it.
+	if (!num_clients_)
+		return;
+
+	// Make the frame into a complete part, so that clients just send the one buffer. This goes in
+	// the buffer of an earlier frame if no client still has hold of it.
+	char header[128];
+	int header_size = snprintf(header, sizeof(header),
+							   "--frame\r\nContent-Type: image/jpeg\r\nContent-Length: %zu\r\n\r\n", size);
+	std::shared_ptr<std::vector<uint8_t>> buffer = std::move(spare_);
+	if (!buffer)
+		buffer = std::make_shared<std::vector<uint8_t>>();
+	buffer->resize(header_size + size + 2);
+	memcpy(buffer->data(), header, header_size);
+	memcpy(buffer->data() + header_size, mem, size);
+	memcpy(buffer->data() + header_size + size, "\r\n", 2);
+
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex_);
+		std::swap(frame_, buffer);
+		sequence_++;
+	}
+	// Clients only take the frame under the lock, so once it's been replaced, a use count of 1 means
+	// that it's ours alone and can't be taken again.
+	if (buffer && buffer.use_count() == 1)
+		spare_ = std::move(buffer);
+	uint64_t value = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &value, sizeof(value));
+}
+
+void HttpOutputMJPEG::serverThread()
+{
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, -1);
+		if (n < 0 && errno != EINTR)
+		{
+			LOG_ERROR("ERROR: HttpOutputMJPEG: epoll_wait failed: " << strerror(errno));
+			return;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				// A new frame. Clients that are idle start on it now, busy ones when they finish.
+				uint64_t value;
+				[[maybe_unused]] ssize_t ret = read(event_fd_, &value, sizeof(value));
+				std::vector<int> fds;
+				for (auto &[client_fd, client] : clients_)
+					if (client.streaming && !client.buffer)
+						fds.push_back(client_fd);
+				for (int client_fd : fds)
+					sendToClient(clients_.at(client_fd));
+			}
+			else
+			{
+				auto it = clients_.find(fd);
+				if (it == clients_.end())
+					continue;
+				if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+					dropClient(fd);
+				else
+				{
+					if (events[i].events & EPOLLIN)
+						readFromClient(it->second);
+					if ((events[i].events & EPOLLOUT) && clients_.count(fd))
+						sendToClient(it->second);
+				}
+			}
+		}
+	}
+}
+
+void HttpOutputMJPEG::acceptClients()
+{
+	while (true)
+	{
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		if (clients_.size() >= MAX_CLIENTS)
+		{
+			LOG(1, "HttpOutputMJPEG: too many clients, refusing connection");
+			close(fd);
+			continue;
+		}
+
+		// Edge triggered, so that a client waiting for its socket to drain costs nothing.
+		epoll_event event = {};
+		event.events = EPOLLIN | EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			close(fd);
+			continue;
+		}
+		clients_[fd].fd = fd;
+		num_clients_ = clients_.size();
+		LOG(2, "HttpOutputMJPEG: client " << fd << " connected, " << clients_.size() << " now");
+	}
+}
+
+void HttpOutputMJPEG::readFromClient(Client &client)
+{
+	char data[1024];
+	ssize_t n;
+	while ((n = recv(client.fd, data, sizeof(data), 0)) > 0)
+	{
+		// Once streaming, anything more the client sends is of no interest.
+		if (client.streaming)
+			continue;
+		client.request.append(data, n);
+		if (client.request.size() > MAX_REQUEST_SIZE)
+		{
+			dropClient(client.fd);
+			return;
+		}
+	}
+	if (n == 0 || (errno != EAGAIN && errno != EWOULDBLOCK))
+	{
+		dropClient(client.fd);
+		return;
+	}
+
+	if (client.streaming || client.request.find("\r\n\r\n") == std::string::npos)
+		return;
+	// Whatever was asked for, the stream is the only thing we serve.
+	if (client.request.compare(0, 4, "GET ") != 0)
+	{
+		[[maybe_unused]] ssize_t ret = send(client.fd, BAD_REQUEST, sizeof(BAD_REQUEST) - 1, MSG_NOSIGNAL);
+		dropClient(client.fd);
+		return;
+	}
+	client.streaming = true;
+	client.request.clear();
+	client.buffer = std::make_shared<std::vector<uint8_t> const>(RESPONSE, RESPONSE + sizeof(RESPONSE) - 1);
+	client.sent = 0;
+	sendToClient(client);
+}
+
+void HttpOutputMJPEG::sendToClient(Client &client)
+{
+	while (client.streaming)
+	{
+		if (!client.buffer)
+		{
+			std::lock_guard<std::mutex> lock(frame_mutex_);
+			if (!frame_ || client.sequence == sequence_)
+				return;
+			client.buffer = frame_;
+			client.sequence = sequence_;
+			client.sent = 0;
+		}
+
+		ssize_t n = send(client.fd, client.buffer->data() + client.sent, client.buffer->size() - client.sent,
+						 MSG_NOSIGNAL | MSG_DONTWAIT);
+		if (n < 0)
+		{
+			// Full up, so wait for EPOLLOUT, by which time there may be newer frames to skip to.
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				dropClient(client.fd);
+			return;
+		}
+		client.sent += n;
+		if (client.sent == client.buffer->size())
+			client.buffer.reset();
+	}
+}
+
+void HttpOutputMJPEG::dropClient(int fd)
+{
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients_.erase(fd);
+	num_clients_ = clients_.size();
+	// No more frames are made until someone connects, so don't let them start with this one.
+	if (clients_.empty())
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex_);
+		frame_.reset();
+	}
+	LOG(2, "HttpOutputMJPEG: client " << fd << " disconnected, " << clients_.size() << " now");
+}
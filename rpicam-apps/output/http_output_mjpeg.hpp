@@ -0,0 +1,70 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * http_output_mjpeg.hpp - Serve the preview JPEGs as a multipart MJPEG stream over HTTP.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "output.hpp"
+
+// Any number of HTTP clients get a multipart/x-mixed-replace stream of the frames. One thread runs
+// a non-blocking epoll loop over all the sockets. Each frame is copied once into a buffer that all
+// the clients send from, or not at all while there are no clients, and a client that can't keep up
+// just skips to the latest frame when it's ready for another, so it never holds up anyone else.
+class HttpOutputMJPEG : public Output
+{
+public:
+	HttpOutputMJPEG(VideoOptions const *options);
+	~HttpOutputMJPEG();
+
+	// Number of clients connected, which may be read from any thread.
+	unsigned int Clients() const { return num_clients_; }
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	// A frame with its part headers and trailer, ready to send as it is.
+	typedef std::shared_ptr<std::vector<uint8_t> const> Buffer;
+
+	struct Client
+	{
+		int fd;
+		std::string request;
+		bool streaming = false;
+		// What we're part way through sending, and the last frame we started.
+		Buffer buffer;
+		size_t sent = 0;
+		uint64_t sequence = 0;
+	};
+
+	void serverThread();
+	void acceptClients();
+	void readFromClient(Client &client);
+	// Send as much as the socket will take, moving on to the latest frame whenever one is finished.
+	void sendToClient(Client &client);
+	void dropClient(int fd);
+
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	std::atomic<bool> abort_;
+	std::thread server_thread_;
+	std::map<int, Client> clients_;
+	std::atomic<unsigned int> num_clients_;
+
+	std::mutex frame_mutex_;
+	std::shared_ptr<std::vector<uint8_t>> frame_;
+	uint64_t sequence_;
+	// An earlier frame's buffer, for the next frame to reuse. Only the encoder's thread touches it.
+	std::shared_ptr<std::vector<uint8_t>> spare_;
+};
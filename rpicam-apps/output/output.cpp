@@ -11,6 +11,7 @@
 #include "circular_output.hpp"
 #include "file_output.hpp"
 #include "file_output_mjpeg.hpp"
+#include "http_output_mjpeg.hpp"
 #include "net_output.hpp"
 #include "output.hpp"
 
@@ -117,7 +118,9 @@ Output *Output::Create(VideoOptions const *options)
 
 Output *Output::Create(VideoOptions const *options, RPiCamMJPEGEncoder *encoder)
 {
-	if (!options->output.empty())
+	if (strncmp(options->output.c_str(), "http://", 7) == 0)
+		return new HttpOutputMJPEG(options);
+	else if (!options->output.empty())
 		return new FileOutputMJPEG(options, encoder);
 	else
 		return Create((const VideoOptions *)options);
@@ -0,0 +1,100 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_output_mjpeg.cpp - Write the preview JPEGs into a shared memory ring.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <new>
+
+#include "shm_output_mjpeg.hpp"
+
+ShmOutputMJPEG::ShmOutputMJPEG(VideoOptions const *options, unsigned int num_slots, unsigned int slot_size)
+	: Output(options), header_(nullptr), size_(0), warned_(false)
+{
+	if (num_slots < 2 || !slot_size)
+		throw std::runtime_error("shared memory ring needs at least 2 slots");
+
+	// Start each slot's data on a cache line of its own.
+	size_t data_start = (sizeof(ShmRingHeader) + num_slots * sizeof(ShmRingHeader::Slot) + 63) & ~63;
+	slot_size = (slot_size + 63) & ~63;
+	size_ = data_start + (size_t)num_slots * slot_size;
+	if (size_ > UINT32_MAX)
+		throw std::runtime_error("shared memory ring too large");
+
+	std::string const &path = options_->output;
+	std::filesystem::path parent = std::filesystem::path(path).parent_path();
+	if (!parent.empty())
+		std::filesystem::create_directories(parent);
+	std::string tmp_path = path + ".tmp";
+	int fd = open(tmp_path.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+	if (fd < 0)
+		throw std::runtime_error("failed to create " + tmp_path + ": " + strerror(errno));
+	void *mem = MAP_FAILED;
+	if (ftruncate(fd, size_) == 0)
+		mem = mmap(nullptr, size_, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	close(fd);
+	if (mem == MAP_FAILED)
+	{
+		unlink(tmp_path.c_str());
+		throw std::runtime_error("failed to map " + tmp_path + ": " + strerror(errno));
+	}
+
+	// The file starts out zeroed, so all the counters are already 0.
+	header_ = new (mem) ShmRingHeader;
+	memcpy(header_->magic, ShmRingHeader::MAGIC, sizeof(header_->magic));
+	header_->version = ShmRingHeader::VERSION;
+	header_->num_slots = num_slots;
+	header_->slot_size = slot_size;
+	for (unsigned int i = 0; i < num_slots; i++)
+	{
+		ShmRingHeader::Slot *slot = new (&header_->Slots()[i]) ShmRingHeader::Slot;
+		slot->offset = data_start + i * slot_size;
+	}
+	header_->active.store(1, std::memory_order_release);
+
+	if (rename(tmp_path.c_str(), path.c_str()) < 0)
+	{
+		munmap(mem, size_);
+		unlink(tmp_path.c_str());
+		throw std::runtime_error("failed to create " + path + ": " + strerror(errno));
+	}
+	LOG(2, "ShmOutputMJPEG: " << num_slots << " slots of " << slot_size << " bytes in " << path);
+}
+
+ShmOutputMJPEG::~ShmOutputMJPEG()
+{
+	// Leave the last frames for anyone still reading, but tell them we've gone.
+	header_->active.store(0, std::memory_order_release);
+	munmap(header_, size_);
+}
+
+void ShmOutputMJPEG::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	if (size > header_->slot_size)
+	{
+		if (!warned_)
+			LOG_ERROR("WARNING: ShmOutputMJPEG: " << size << " byte frame doesn't fit in a "
+												   << header_->slot_size << " byte slot, skipping");
+		warned_ = true;
+		return;
+	}
+
+	// We're the only writer, so nothing else changes the sequence or the locks.
+	uint64_t frame = header_->sequence.load(std::memory_order_relaxed) + 1;
+	ShmRingHeader::Slot &slot = header_->Slots()[(frame - 1) % header_->num_slots];
+	uint64_t lock = slot.lock.load(std::memory_order_relaxed);
+	slot.lock.store(lock + 1, std::memory_order_relaxed);
+	std::atomic_thread_fence(std::memory_order_release);
+
+	memcpy((uint8_t *)header_ + slot.offset, mem, size);
+	slot.frame.store(frame, std::memory_order_relaxed);
+	slot.timestamp_us.store(timestamp_us, std::memory_order_relaxed);
+	slot.size.store(size, std::memory_order_relaxed);
+
+	slot.lock.store(lock + 2, std::memory_order_release);
+	header_->sequence.store(frame, std::memory_order_release);
+}
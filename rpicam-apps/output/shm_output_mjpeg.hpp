@@ -0,0 +1,29 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_output_mjpeg.hpp - Write the preview JPEGs into a shared memory ring.
+ */
+
+#pragma once
+
+#include "output.hpp"
+#include "shm_ring.hpp"
+
+// Publishes each frame into the next slot of a ring file that local readers map (see shm_ring.hpp),
+// so that they can pick up the newest frame without any syscalls. The ring is built under a
+// temporary name and renamed into place, so a reader never sees one half set up.
+class ShmOutputMJPEG : public Output
+{
+public:
+	ShmOutputMJPEG(VideoOptions const *options, unsigned int num_slots, unsigned int slot_size);
+	~ShmOutputMJPEG();
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	ShmRingHeader *header_;
+	size_t size_;
+	bool warned_;
+};
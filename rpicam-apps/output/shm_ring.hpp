@@ -0,0 +1,159 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * shm_ring.hpp - Layout of the shared memory ring of preview JPEGs, and a reader for it.
+ */
+
+#pragma once
+
+#include <algorithm>
+#include <atomic>
+#include <cstdint>
+#include <cstring>
+#include <stdexcept>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+// The ring is a file (normally in /dev/shm) holding this header, then num_slots Slot records, then
+// the slots' data, slot_size bytes each. Frames are written to the slots in turn, and sequence
+// counts the frames written, so the newest is in slot (sequence - 1) % num_slots. Each slot has its
+// own seqlock: its lock value is odd while the writer is changing it, and different once the writer
+// has been back. Everything is native endian, and only the writer changes anything.
+struct ShmRingHeader
+{
+	static constexpr char MAGIC[8] = { 'M', 'J', 'P', 'G', 'R', 'I', 'N', 'G' };
+	static constexpr uint32_t VERSION = 1;
+
+	struct Slot
+	{
+		std::atomic<uint64_t> lock;
+		std::atomic<uint64_t> frame;
+		std::atomic<int64_t> timestamp_us;
+		std::atomic<uint32_t> size;
+		// Offset of the slot's data from the start of the file.
+		uint32_t offset;
+	};
+
+	char magic[8];
+	uint32_t version;
+	uint32_t num_slots;
+	uint32_t slot_size;
+	// Cleared when the writer stops, after which it may create a new ring with the same name.
+	std::atomic<uint32_t> active;
+	std::atomic<uint64_t> sequence;
+
+	Slot *Slots() { return reinterpret_cast<Slot *>(this + 1); }
+	Slot const *Slots() const { return reinterpret_cast<Slot const *>(this + 1); }
+};
+
+static_assert(std::atomic<uint64_t>::is_always_lock_free, "shared memory ring needs lock-free 64-bit atomics");
+
+// Reads frames from a ring written by rpicam-mjpeg's --preview-shm. Once the ring is mapped,
+// finding the newest frame and checking it afterwards involve no syscalls and no copies. A frame's
+// data is only overwritten after num_slots - 1 newer frames, so to use it in place, call Newest(),
+// read the data, and then call Valid() to check the writer didn't get to it in the meantime.
+class ShmRingReader
+{
+public:
+	struct Frame
+	{
+		uint8_t const *data;
+		size_t size;
+		uint64_t frame;
+		int64_t timestamp_us;
+		unsigned int slot;
+		uint64_t lock;
+	};
+
+	explicit ShmRingReader(std::string const &path)
+	{
+		int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd < 0)
+			throw std::runtime_error("failed to open " + path);
+		struct stat st;
+		if (fstat(fd, &st) < 0 || (size_t)st.st_size < sizeof(ShmRingHeader))
+		{
+			close(fd);
+			throw std::runtime_error(path + " is not a JPEG ring");
+		}
+		size_ = st.st_size;
+		void *mem = mmap(nullptr, size_, PROT_READ, MAP_SHARED, fd, 0);
+		close(fd);
+		if (mem == MAP_FAILED)
+			throw std::runtime_error("failed to map " + path);
+		header_ = (ShmRingHeader const *)mem;
+		bool ok = !memcmp(header_->magic, ShmRingHeader::MAGIC, sizeof(header_->magic)) &&
+				  header_->version == ShmRingHeader::VERSION && header_->num_slots &&
+				  sizeof(ShmRingHeader) + header_->num_slots * sizeof(ShmRingHeader::Slot) <= size_;
+		for (unsigned int i = 0; ok && i < header_->num_slots; i++)
+			ok = (size_t)header_->Slots()[i].offset + header_->slot_size <= size_;
+		if (!ok)
+		{
+			munmap(mem, size_);
+			throw std::runtime_error(path + " is not a JPEG ring");
+		}
+	}
+	~ShmRingReader() { munmap((void *)header_, size_); }
+	ShmRingReader(ShmRingReader const &) = delete;
+	ShmRingReader &operator=(ShmRingReader const &) = delete;
+
+	ShmRingHeader const &Header() const { return *header_; }
+	// False once the writer has stopped, when the ring should be opened again to find a new one.
+	bool Active() const { return header_->active.load(std::memory_order_acquire); }
+	// Number of frames written so far.
+	uint64_t Sequence() const { return header_->sequence.load(std::memory_order_acquire); }
+
+	// Find the newest frame, returning false if there isn't one yet.
+	bool Newest(Frame &frame) const
+	{
+		while (true)
+		{
+			uint64_t sequence = Sequence();
+			if (!sequence)
+				return false;
+			frame.slot = (sequence - 1) % header_->num_slots;
+			ShmRingHeader::Slot const &slot = header_->Slots()[frame.slot];
+			frame.lock = slot.lock.load(std::memory_order_acquire);
+			if (frame.lock & 1)
+				continue;
+			frame.frame = slot.frame.load(std::memory_order_relaxed);
+			frame.timestamp_us = slot.timestamp_us.load(std::memory_order_relaxed);
+			frame.size = std::min<size_t>(slot.size.load(std::memory_order_relaxed), header_->slot_size);
+			frame.data = (uint8_t const *)header_ + slot.offset;
+			if (Valid(frame))
+				return true;
+		}
+	}
+
+	// Whether the frame's data is still intact, having been read.
+	bool Valid(Frame const &frame) const
+	{
+		std::atomic_thread_fence(std::memory_order_acquire);
+		return header_->Slots()[frame.slot].lock.load(std::memory_order_relaxed) == frame.lock;
+	}
+
+	// Copy out the newest frame, returning its frame number, or 0 if there isn't one yet.
+	uint64_t CopyNewest(std::vector<uint8_t> &data, int64_t *timestamp_us = nullptr) const
+	{
+		Frame frame;
+		do
+		{
+			if (!Newest(frame))
+				return 0;
+			data.assign(frame.data, frame.data + frame.size);
+		} while (!Valid(frame));
+		if (timestamp_us)
+			*timestamp_us = frame.timestamp_us;
+		return frame.frame;
+	}
+
+private:
+	ShmRingHeader const *header_;
+	size_t size_;
+};
@@ -0,0 +1,255 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * socket_output_mjpeg.cpp - Hand the preview JPEGs to local clients over a Unix domain socket.
+ */
+
+#include <cerrno>
+#include <cstring>
+#include <filesystem>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "socket_output_mjpeg.hpp"
+
+static constexpr unsigned int MAX_CLIENTS = 32;
+// Keeps the frames queued for a client that isn't reading down to a handful. A full socket just
+// means the client misses frames.
+static constexpr int CLIENT_SEND_BUFFER = 8192;
+
+SocketOutputMJPEG::Frame::~Frame()
+{
+	close(fd);
+}
+
+SocketOutputMJPEG::SocketOutputMJPEG(VideoOptions const *options)
+	: Output(options), path_(options->output), listen_fd_(-1), epoll_fd_(-1), event_fd_(-1), abort_(false),
+	  num_clients_(0), warned_(false), sequence_(0)
+{
+	sockaddr_un saddr = {};
+	saddr.sun_family = AF_UNIX;
+	if (path_.size() >= sizeof(saddr.sun_path))
+		throw std::runtime_error("socket path too long: " + path_);
+	memcpy(saddr.sun_path, path_.c_str(), path_.size());
+
+	std::filesystem::path parent = std::filesystem::path(path_).parent_path();
+	if (!parent.empty())
+		std::filesystem::create_directories(parent);
+	// A socket left behind by an earlier run would stop us binding, but don't remove anything else.
+	struct stat st;
+	if (lstat(path_.c_str(), &st) == 0 && S_ISSOCK(st.st_mode))
+		unlink(path_.c_str());
+
+	listen_fd_ = socket(AF_UNIX, SOCK_SEQPACKET | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (listen_fd_ < 0)
+		throw std::runtime_error("unable to open unix listen socket");
+	// Only remove the path once we've bound it, as otherwise it isn't ours.
+	bool bound = bind(listen_fd_, (sockaddr *)&saddr, sizeof(saddr)) == 0;
+	if (!bound || listen(listen_fd_, 8) < 0)
+	{
+		int err = errno;
+		close(listen_fd_);
+		if (bound)
+			unlink(path_.c_str());
+		throw std::runtime_error("failed to listen on " + path_ + ": " + strerror(err));
+	}
+
+	epoll_fd_ = epoll_create1(EPOLL_CLOEXEC);
+	event_fd_ = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (epoll_fd_ < 0 || event_fd_ < 0)
+	{
+		for (int fd : { epoll_fd_, event_fd_, listen_fd_ })
+		{
+			if (fd >= 0)
+				close(fd);
+		}
+		unlink(path_.c_str());
+		throw std::runtime_error("failed to create socket server epoll fds");
+	}
+	epoll_event event = {};
+	event.events = EPOLLIN;
+	event.data.fd = listen_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, listen_fd_, &event);
+	event.data.fd = event_fd_;
+	epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, event_fd_, &event);
+
+	server_thread_ = std::thread(&SocketOutputMJPEG::serverThread, this);
+	LOG(2, "SocketOutputMJPEG: serving on " << path_);
+}
+
+SocketOutputMJPEG::~SocketOutputMJPEG()
+{
+	abort_ = true;
+	uint64_t value = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &value, sizeof(value));
+	server_thread_.join();
+	for (auto const &[fd, sequence] : clients_)
+		close(fd);
+	close(event_fd_);
+	close(epoll_fd_);
+	close(listen_fd_);
+	unlink(path_.c_str());
+}
+
+void SocketOutputMJPEG::outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags)
+{
+	// Nobody to send it to, so don't bother making the memfd.
+	if (!num_clients_)
+		return;
+
+	int fd = memfd_create("rpicam-mjpeg-frame", MFD_CLOEXEC | MFD_ALLOW_SEALING);
+	bool ok = fd >= 0;
+	for (size_t done = 0; ok && done < size;)
+	{
+		ssize_t n = write(fd, (uint8_t *)mem + done, size - done);
+		ok = n > 0;
+		done += ok ? n : 0;
+	}
+	ok = ok && fcntl(fd, F_ADD_SEALS, F_SEAL_SHRINK | F_SEAL_GROW | F_SEAL_WRITE | F_SEAL_SEAL) == 0;
+	if (!ok)
+	{
+		if (!warned_)
+			LOG_ERROR("WARNING: SocketOutputMJPEG: failed to make frame memfd: " << strerror(errno));
+		warned_ = true;
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex_);
+		sequence_++;
+		frame_ = std::make_shared<Frame const>(fd, SocketFrameHeader { sequence_, timestamp_us, size });
+	}
+	uint64_t value = 1;
+	[[maybe_unused]] ssize_t ret = write(event_fd_, &value, sizeof(value));
+}
+
+void SocketOutputMJPEG::serverThread()
+{
+	epoll_event events[16];
+	while (!abort_)
+	{
+		int n = epoll_wait(epoll_fd_, events, 16, -1);
+		if (n < 0 && errno != EINTR)
+		{
+			LOG_ERROR("ERROR: SocketOutputMJPEG: epoll_wait failed: " << strerror(errno));
+			return;
+		}
+
+		for (int i = 0; i < n; i++)
+		{
+			int fd = events[i].data.fd;
+			if (fd == listen_fd_)
+				acceptClients();
+			else if (fd == event_fd_)
+			{
+				uint64_t value;
+				[[maybe_unused]] ssize_t ret = read(event_fd_, &value, sizeof(value));
+				std::vector<int> fds;
+				for (auto const &[client_fd, sequence] : clients_)
+					fds.push_back(client_fd);
+				for (int client_fd : fds)
+					sendToClient(client_fd, clients_.at(client_fd));
+			}
+			else
+			{
+				auto it = clients_.find(fd);
+				if (it == clients_.end())
+					continue;
+				if (events[i].events & (EPOLLERR | EPOLLHUP | EPOLLRDHUP))
+					dropClient(fd);
+				else if (events[i].events & EPOLLOUT)
+					sendToClient(fd, it->second);
+			}
+		}
+	}
+}
+
+void SocketOutputMJPEG::acceptClients()
+{
+	while (true)
+	{
+		int fd = accept4(listen_fd_, nullptr, nullptr, SOCK_NONBLOCK | SOCK_CLOEXEC);
+		if (fd < 0)
+			return;
+		if (clients_.size() >= MAX_CLIENTS)
+		{
+			LOG(1, "SocketOutputMJPEG: too many clients, refusing connection");
+			close(fd);
+			continue;
+		}
+
+		// Clients have nothing to say, so we only listen for them going away, and for room to send.
+		setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &CLIENT_SEND_BUFFER, sizeof(CLIENT_SEND_BUFFER));
+		epoll_event event = {};
+		event.events = EPOLLOUT | EPOLLRDHUP | EPOLLET;
+		event.data.fd = fd;
+		if (epoll_ctl(epoll_fd_, EPOLL_CTL_ADD, fd, &event) < 0)
+		{
+			close(fd);
+			continue;
+		}
+		// New clients start with the next frame, as the last one might be from before anyone was listening.
+		std::lock_guard<std::mutex> lock(frame_mutex_);
+		clients_[fd] = sequence_;
+		num_clients_ = clients_.size();
+		LOG(2, "SocketOutputMJPEG: client " << fd << " connected, " << clients_.size() << " now");
+	}
+}
+
+void SocketOutputMJPEG::sendToClient(int fd, uint64_t &sequence)
+{
+	std::shared_ptr<Frame const> frame;
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex_);
+		if (!frame_ || sequence == sequence_)
+			return;
+		frame = frame_;
+	}
+
+	iovec iov = { (void *)&frame->header, sizeof(frame->header) };
+	char control[CMSG_SPACE(sizeof(int))] = {};
+	msghdr msg = {};
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = control;
+	msg.msg_controllen = sizeof(control);
+	cmsghdr *cmsg = CMSG_FIRSTHDR(&msg);
+	cmsg->cmsg_level = SOL_SOCKET;
+	cmsg->cmsg_type = SCM_RIGHTS;
+	cmsg->cmsg_len = CMSG_LEN(sizeof(int));
+	memcpy(CMSG_DATA(cmsg), &frame->fd, sizeof(int));
+
+	if (sendmsg(fd, &msg, MSG_NOSIGNAL | MSG_DONTWAIT) < 0)
+	{
+		// Full up, so wait for EPOLLOUT, by which time there may be newer frames to skip to.
+		if (errno != EAGAIN && errno != EWOULDBLOCK)
+			dropClient(fd);
+		return;
+	}
+	sequence = frame->header.sequence;
+}
+
+void SocketOutputMJPEG::dropClient(int fd)
+{
+	epoll_ctl(epoll_fd_, EPOLL_CTL_DEL, fd, nullptr);
+	close(fd);
+	clients_.erase(fd);
+	num_clients_ = clients_.size();
+	if (clients_.empty())
+	{
+		std::lock_guard<std::mutex> lock(frame_mutex_);
+		frame_.reset();
+	}
+	LOG(2, "SocketOutputMJPEG: client " << fd << " disconnected, " << clients_.size() << " now");
+}
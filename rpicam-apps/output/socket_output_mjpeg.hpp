@@ -0,0 +1,75 @@
+/* SPDX-License-Identifier: BSD-2-Clause */
+/*
+ * Copyright (C) 2020, Raspberry Pi (Trading) Ltd.
+ *
+ * socket_output_mjpeg.hpp - Hand the preview JPEGs to local clients over a Unix domain socket.
+ */
+
+#pragma once
+
+#include <atomic>
+#include <cstdint>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <string>
+#include <thread>
+
+#include "output.hpp"
+
+// Each message a client receives on the (SOCK_SEQPACKET) socket is one of these, with the JPEG in a
+// sealed memfd passed alongside it as SCM_RIGHTS. The client can mmap the memfd, and must close it.
+struct SocketFrameHeader
+{
+	uint64_t sequence;
+	int64_t timestamp_us;
+	uint64_t size;
+};
+
+// Any number of local clients connect to the socket and get sent each frame as it's output. A frame
+// is written once, to a memfd that is sealed so that no one can change it, and the same fd is passed
+// to every client, so a frame costs the same however many clients there are. One thread runs a
+// non-blocking epoll loop over the sockets, and a client whose socket is full just gets the latest
+// frame when it has room again, so it never holds up anyone else.
+class SocketOutputMJPEG : public Output
+{
+public:
+	SocketOutputMJPEG(VideoOptions const *options);
+	~SocketOutputMJPEG();
+
+	// Number of clients connected, which may be read from any thread.
+	unsigned int Clients() const { return num_clients_; }
+
+protected:
+	void outputBuffer(void *mem, size_t size, int64_t timestamp_us, uint32_t flags) override;
+
+private:
+	struct Frame
+	{
+		Frame(int fd, SocketFrameHeader const &header) : fd(fd), header(header) {}
+		~Frame();
+		int fd;
+		SocketFrameHeader header;
+	};
+
+	void serverThread();
+	void acceptClients();
+	// Send the latest frame, unless the client has it already or its socket is full.
+	void sendToClient(int fd, uint64_t &sequence);
+	void dropClient(int fd);
+
+	std::string path_;
+	int listen_fd_;
+	int epoll_fd_;
+	int event_fd_;
+	std::atomic<bool> abort_;
+	std::thread server_thread_;
+	// The last frame sent to each client.
+	std::map<int, uint64_t> clients_;
+	std::atomic<unsigned int> num_clients_;
+	bool warned_;
+
+	std::mutex frame_mutex_;
+	std::shared_ptr<Frame const> frame_;
+	uint64_t sequence_;
+};
@@ -152,6 +152,8 @@ bool internalMotionDetectStage::Process(CompletedRequestPtr &completed_request){
     //     }
     // }
     
+    // Let the rest of the app (e.g. preview frame skipping) know as well
+    completed_request->post_process_metadata.Set("motion_detect.result", motion_detected);
 
     // Update the previous frame
     prev_frame = current_frame.clone();